@@ -0,0 +1,282 @@
+import argparse
+import bisect
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# Benchmark of the whole sorter on generated files. Each configuration
+# of a dataset, a size, a file count, a number of workers and a target
+# latency is run several times. The report is JSON, so the reports of
+# two commits can be compared with --compare.
+
+maxint = 1 << 31
+
+parser = argparse.ArgumentParser(description = "Run the sorter on generated "\
+					       "datasets and write a report")
+parser.add_argument('-e', type=str, default='./bench_solution',
+		    help='sorter executable')
+parser.add_argument('-o', type=str, default='bench_report.json',
+		    help='report file')
+parser.add_argument('--datasets', type=str,
+		    default='sorted,reverse,dups,uniform,zipf',
+		    help='comma-separated datasets')
+parser.add_argument('--sizes', type=str, default='40000,200000',
+		    help='numbers per file, comma-separated')
+parser.add_argument('--files', type=str, default='6',
+		    help='file counts, comma-separated')
+parser.add_argument('--workers', type=str, default='1,4,16',
+		    help='worker counts, comma-separated')
+parser.add_argument('--latencies', type=str, default='100,10000',
+		    help='target latencies in microseconds, comma-separated')
+parser.add_argument('--repeats', type=int, default=3,
+		    help='runs per configuration, the best time is taken')
+parser.add_argument('--args', type=str, default='',
+		    help='extra sorter options, like "--sort intro"')
+parser.add_argument('--compare', type=str, default=None,
+		    help='old report to compare the throughput with')
+parser.add_argument('--threshold', type=float, default=5,
+		    help='throughput change in %% to report as a regression')
+parser.add_argument('--quick', action='store_true',
+		    help='one small size, 2 repeats')
+args = parser.parse_args()
+
+
+def int_list(text):
+	return [int(x) for x in text.split(',') if x != '']
+
+
+def gen_uniform(rnd, count):
+	return [rnd.randint(0, maxint - 1) for i in range(count)]
+
+
+def gen_sorted(rnd, count):
+	return sorted(gen_uniform(rnd, count))
+
+
+def gen_reverse(rnd, count):
+	return sorted(gen_uniform(rnd, count), reverse=True)
+
+
+# ~100 distinct values
+def gen_dups(rnd, count):
+	return [rnd.randint(0, 99) for i in range(count)]
+
+
+# Zipf with s = 1.1 over 10000 distinct values: a few are very
+# frequent, most are rare.
+zipf_values = None
+zipf_weights = None
+
+
+def gen_zipf(rnd, count):
+	global zipf_values, zipf_weights
+	if zipf_values is None:
+		zipf_values = [rnd.randint(0, maxint - 1) for i in range(10000)]
+		total = 0
+		zipf_weights = []
+		for rank in range(1, len(zipf_values) + 1):
+			total += 1 / rank ** 1.1
+			zipf_weights.append(total)
+	total = zipf_weights[-1]
+	return [zipf_values[bisect.bisect(zipf_weights, rnd.random() * total)]
+		for i in range(count)]
+
+
+generators = {
+	'sorted': gen_sorted,
+	'reverse': gen_reverse,
+	'dups': gen_dups,
+	'uniform': gen_uniform,
+	'zipf': gen_zipf,
+}
+
+
+def generate(directory, dataset, size, file_count):
+	# The same seed for each configuration, so as the data is the
+	# same in the reports of different commits.
+	rnd = random.Random('{} {} {}'.format(dataset, size, file_count))
+	paths = []
+	for i in range(file_count):
+		path = os.path.join(directory, '{}_{}_{}.txt'.format(dataset, size, i))
+		with open(path, 'w') as f:
+			f.write(' '.join(map(str, generators[dataset](rnd, size))))
+		paths.append(path)
+	return paths
+
+
+# The sorter prints its VmHWM, and with --procs each process does. The
+# ru_maxrss of the child, given by wait4(), is not used: it includes the
+# memory of this Python process, which the child had before exec().
+def parse_output(text):
+	result = {'time_ms': None, 'slice_p50_ms': [], 'slice_p99_ms': [],
+		  'peak_rss_kib': None}
+	for line in text.splitlines():
+		words = line.split()
+		if line.startswith('Total work time:'):
+			result['time_ms'] = float(words[3].rstrip('ms'))
+		elif line.startswith('  slice p50'):
+			result['slice_p50_ms'].append(float(words[2].rstrip('ms,')))
+			result['slice_p99_ms'].append(float(words[4].rstrip('ms;')))
+		elif line.startswith('Peak memory:'):
+			result['peak_rss_kib'] = max_known(
+				[result['peak_rss_kib'], int(words[2])])
+	return result
+
+
+def run(directory, command):
+	start = time.monotonic()
+	p = subprocess.run(command, cwd=directory, stdout=subprocess.PIPE,
+			   stderr=subprocess.STDOUT)
+	text = p.stdout.decode()
+	if p.returncode != 0:
+		print('Failed: {}\n{}'.format(' '.join(command), text))
+		exit(1)
+	result = parse_output(text)
+	if result['time_ms'] is None:
+		result['time_ms'] = (time.monotonic() - start) * 1000
+	return result
+
+
+def check_output(directory, expected_count):
+	with open(os.path.join(directory, 'output.txt')) as f:
+		numbers = [int(x) for x in f.read().split()]
+	if len(numbers) != expected_count:
+		return False
+	return all(numbers[i] <= numbers[i + 1] for i in range(len(numbers) - 1))
+
+
+# None, if there are no values. A missing measurement is null in the
+# report, not 0.
+def median(values):
+	if len(values) == 0:
+		return None
+	values = sorted(values)
+	return values[len(values) // 2]
+
+
+def max_known(values):
+	values = [x for x in values if x is not None]
+	return max(values) if len(values) > 0 else None
+
+
+def format_known(value, spec):
+	return '-' if value is None else format(value, spec)
+
+
+def config_key(r):
+	return (r['dataset'], r['size'], r['files'], r['workers'],
+		r['latency_us'])
+
+
+def compare(old_path, results):
+	with open(old_path) as f:
+		old = {config_key(r): r for r in json.load(f)['results']}
+	regressions = 0
+	print('{:<8} {:>7} {:>5} {:>7} {:>8} {:>10} {:>10} {:>8}'.format(
+		'dataset', 'size', 'files', 'workers', 'latency', 'old M/s',
+		'new M/s', 'change'))
+	for r in results:
+		o = old.get(config_key(r))
+		if o is None:
+			continue
+		change = (r['numbers_per_sec'] / o['numbers_per_sec'] - 1) * 100
+		mark = ''
+		if change < -args.threshold:
+			mark = ' <- regression'
+			regressions += 1
+		print('{:<8} {:>7} {:>5} {:>7} {:>8} {:>10.2f} {:>10.2f} {:>+7.1f}%{}'
+		      .format(r['dataset'], r['size'], r['files'], r['workers'],
+			      r['latency_us'], o['numbers_per_sec'] / 1e6,
+			      r['numbers_per_sec'] / 1e6, change, mark))
+	print('{} regressions over {}%'.format(regressions, args.threshold))
+
+
+if args.quick:
+	args.sizes = '40000'
+	args.repeats = 2
+
+datasets = args.datasets.split(',')
+for dataset in datasets:
+	if dataset not in generators:
+		print('Unknown dataset {}'.format(dataset))
+		exit(1)
+executable = os.path.abspath(args.e)
+extra = args.args.split()
+results = []
+directory = tempfile.mkdtemp(prefix='sort_bench_')
+try:
+	for dataset in datasets:
+		for size in int_list(args.sizes):
+			for file_count in int_list(args.files):
+				paths = generate(directory, dataset, size, file_count)
+				total = size * file_count
+				for workers in int_list(args.workers):
+					for latency in int_list(args.latencies):
+						base = [executable] + extra + [str(latency),
+									       str(workers)]
+						times = []
+						peak_rss = None
+						for i in range(args.repeats):
+							r = run(directory, base + paths)
+							times.append(r['time_ms'])
+							peak_rss = max_known([peak_rss, r['peak_rss_kib']])
+						if not check_output(directory, total):
+							print('Wrong output: {}'.format(' '.join(base)))
+							exit(1)
+						# A separate run: tracing slows the sorter. It
+						# is not supported with --procs.
+						traced = {'slice_p50_ms': [], 'slice_p99_ms': []}
+						if '--procs' not in extra:
+							traced = run(directory, [executable, '--trace',
+										 os.path.join(directory,
+											      'trace.json')] +
+								     base[1:] + paths)
+						best = min(times)
+						result = {
+							'dataset': dataset,
+							'size': size,
+							'files': file_count,
+							'workers': workers,
+							'latency_us': latency,
+							'time_ms': best,
+							'time_ms_median': median(times),
+							'numbers_per_sec': total / best * 1000,
+							'slice_p50_ms': median(traced['slice_p50_ms']),
+							'slice_p99_ms': max_known(traced['slice_p99_ms']),
+							'peak_rss_kib': peak_rss,
+						}
+						results.append(result)
+						print('{:<8} {:>7} x{:<3} workers {:<3} latency {:<6} '
+						      '{:>9.2f} ms  {:>7.2f} M/s  slice p50 {} '
+						      'p99 {} ms  rss {} KiB'.format(
+							      dataset, size, file_count, workers, latency,
+							      best, result['numbers_per_sec'] / 1e6,
+							      format_known(result['slice_p50_ms'], '.3f'),
+							      format_known(result['slice_p99_ms'], '.3f'),
+							      format_known(peak_rss, 'd')))
+						sys.stdout.flush()
+				for path in paths:
+					os.remove(path)
+finally:
+	shutil.rmtree(directory)
+
+commit = subprocess.run(['git', 'rev-parse', '--short', 'HEAD'],
+			stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+report = {
+	'commit': commit.stdout.decode().strip(),
+	'executable': args.e,
+	'args': args.args,
+	'repeats': args.repeats,
+	'results': results,
+}
+with open(args.o, 'w') as f:
+	json.dump(report, f, indent=1)
+	f.write('\n')
+print('Report is written to {}'.format(args.o))
+if args.compare is not None:
+	compare(args.compare, results)
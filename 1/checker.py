@@ -1,5 +1,6 @@
 import random
 import argparse
+import struct
 
 maxint = 1 << 31
 
@@ -10,11 +11,19 @@ parser.add_argument('-f', type=str, required=True, help="file name")
 args = parser.parse_args()
 
 
-f = open(args.f, 'r')
+f = open(args.f, 'rb')
 data = f.read()
 f.close()
 
-data = data.split()
+# The binary format, see generator.py -b.
+if data[:4] == b'SI32':
+	version, count = struct.unpack_from('<IQ', data, 4)
+	if version != 1 or len(data) != 16 + count * 4:
+		print('Bad binary file')
+		exit(1)
+	data = struct.unpack_from('<{}i'.format(count), data, 16)
+else:
+	data = data.decode().split()
 prev_number = -(1 << 31 - 1)
 for i in range(0, len(data)):
 	try:
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+/*
+ * Micro-benchmark of the libcoro context switch backend. Reports
+ * how many coroutines can be created per second, and how many
+ * switches between two coroutines are done per second. Build it
+ * with 'make bench' to run it with both backends.
+ */
+
+enum {
+	/** Coroutines created at once, then reaped. */
+	BENCH_BATCH = 1000,
+	BENCH_BATCH_COUNT = 100,
+	/** Yields done by each coroutine in the switch test. */
+	BENCH_YIELDS = 1000000,
+	/** Yields done by each coroutine in the scaling test. */
+	BENCH_MANY_YIELDS = 20,
+	/** Small stacks to fit many coroutines. */
+	BENCH_MANY_STACK_SIZE = 16 * 1024,
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_nop_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long count = (long)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+/** Counts up, each value is passed by pointer. */
+static int
+bench_generator_f(void *arg)
+{
+	long count = (long)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield_value(&i);
+	return 0;
+}
+
+static void
+bench_print_stack_stats(void)
+{
+	struct coro_stack_stats stats;
+	coro_stack_stats(&stats);
+	printf("stacks: %zu used, %zu cached, %zu MiB virtual, "
+	       "%zu KiB resident\n", stats.used_count, stats.cached_count,
+	       stats.virtual_size >> 20, stats.resident_size >> 10);
+}
+
+static void
+bench_reap(void)
+{
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+
+	double create_time = 0;
+	for (int i = 0; i < BENCH_BATCH_COUNT; ++i) {
+		double start = bench_now();
+		for (int j = 0; j < BENCH_BATCH; ++j)
+			coro_new(bench_nop_f, NULL);
+		create_time += bench_now() - start;
+		if (i == 0)
+			bench_print_stack_stats();
+		bench_reap();
+	}
+	double created = (double)BENCH_BATCH * BENCH_BATCH_COUNT;
+	printf("creations: %.0f/s (%.1f ns each)\n", created / create_time,
+	       create_time / created * 1e9);
+
+	coro_new(bench_yield_f, (void *)(long)BENCH_YIELDS);
+	coro_new(bench_yield_f, (void *)(long)BENCH_YIELDS);
+	double start = bench_now();
+	bench_reap();
+	double switch_time = bench_now() - start;
+	double switches = 2.0 * BENCH_YIELDS;
+	printf("switches: %.0f/s (%.1f ns each)\n", switches / switch_time,
+	       switch_time / switches * 1e9);
+
+	struct coro *gen = coro_new_generator(bench_generator_f,
+					      (void *)(long)BENCH_YIELDS, NULL);
+	start = bench_now();
+	long sum = 0;
+	long *value;
+	while ((value = coro_resume(gen, NULL)) != NULL)
+		sum += *value;
+	double resume_time = bench_now() - start;
+	coro_delete(gen);
+	printf("generator: %.1f ns per resume and yield (sum %ld)\n",
+	       resume_time / BENCH_YIELDS * 1e9, sum);
+
+	/*
+	 * Scheduling overhead per switch should not depend on the
+	 * number of coroutines.
+	 */
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = BENCH_MANY_STACK_SIZE;
+	const int counts[] = {100, 1000, 30000};
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		start = bench_now();
+		for (int j = 0; j < counts[i]; ++j) {
+			coro_new_ex(bench_yield_f,
+				    (void *)(long)BENCH_MANY_YIELDS, &attr);
+		}
+		bench_reap();
+		double time = bench_now() - start;
+		double count = (double)counts[i] * (BENCH_MANY_YIELDS + 1);
+		printf("%d coroutines: %.1f ns per switch, with creation\n",
+		       counts[i],
+		       time / count * 1e9);
+	}
+	return 0;
+}
@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include "coro_io.h"
+#include "libcoro.h"
+#include "libcoro_impl.h"
+
+enum {
+	/** Max events fetched from epoll at once. */
+	CORO_IO_EVENT_BATCH = 64,
+};
+
+struct coro_io_wait;
+
+/**
+ * Waits of a thread, cancelled from other threads. Only the owner
+ * thread touches its epoll and timers, so the others put the waits
+ * here and interrupt its poll.
+ */
+struct coro_io_cancel_list {
+	pthread_mutex_t lock;
+	struct coro_io_wait *first;
+	/** Eventfd to interrupt the poll. Negative - not used. */
+	int wakeup_fd;
+};
+
+/** A coroutine, waiting for an fd and/or a timer. */
+struct coro_io_wait {
+	/** The waiting coroutine. */
+	struct coro *coro;
+	/** The fd registered in epoll. Negative - no fd. */
+	int fd;
+	/** Absolute CLOCK_MONOTONIC time. Negative - no timer. */
+	double deadline;
+	/** Position in the timer heap, SIZE_MAX if not there. */
+	size_t heap_index;
+	/** Ready events. 0 on timeout. */
+	int revents;
+	/** True, if already woken up by a timer or an event. */
+	bool is_woken;
+	/** True, if woken up by coro_cancel(). */
+	bool is_cancelled;
+	/** The cancel list of the thread, where it waits. */
+	struct coro_io_cancel_list *cancels;
+	/** Next in the cancel list. */
+	struct coro_io_wait *next_cancelled;
+	/** True while in the cancel list. Protected by its lock. */
+	bool is_listed;
+	/** True, if another thread has put it to the cancel list. */
+	bool is_cancel_sent;
+};
+
+/*
+ * The state is per thread. A coroutine waiting for I/O stays on
+ * its thread and is woken up only by this thread: by its poll or
+ * by coro_cancel() called here. Other threads use the cancel list.
+ */
+/** Epoll set of all the waited fds. Created on demand. */
+static __thread int io_epoll = -1;
+static __thread struct coro_io_cancel_list io_cancels = {
+	PTHREAD_MUTEX_INITIALIZER, NULL, -1
+};
+/** Number of coroutines waiting for an fd. */
+static __thread size_t fd_waiter_count = 0;
+/** Binary min-heap of the timers by deadline. */
+static __thread struct coro_io_wait **timer_heap = NULL;
+static __thread size_t timer_count = 0;
+static __thread size_t timer_capacity = 0;
+
+static double
+coro_io_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+coro_timer_set(size_t index, struct coro_io_wait *w)
+{
+	timer_heap[index] = w;
+	w->heap_index = index;
+}
+
+static void
+coro_timer_sift_up(size_t index)
+{
+	struct coro_io_wait *w = timer_heap[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (timer_heap[parent]->deadline <= w->deadline)
+			break;
+		coro_timer_set(index, timer_heap[parent]);
+		index = parent;
+	}
+	coro_timer_set(index, w);
+}
+
+static void
+coro_timer_sift_down(size_t index)
+{
+	struct coro_io_wait *w = timer_heap[index];
+	while (true) {
+		size_t child = index * 2 + 1;
+		if (child >= timer_count)
+			break;
+		if (child + 1 < timer_count &&
+		    timer_heap[child + 1]->deadline < timer_heap[child]->deadline)
+			++child;
+		if (w->deadline <= timer_heap[child]->deadline)
+			break;
+		coro_timer_set(index, timer_heap[child]);
+		index = child;
+	}
+	coro_timer_set(index, w);
+}
+
+static int
+coro_timer_add(struct coro_io_wait *w)
+{
+	if (timer_count == timer_capacity) {
+		size_t capacity = timer_capacity == 0 ? 16 : timer_capacity * 2;
+		struct coro_io_wait **heap =
+			realloc(timer_heap, capacity * sizeof(*heap));
+		if (heap == NULL)
+			return -1;
+		timer_heap = heap;
+		timer_capacity = capacity;
+	}
+	coro_timer_set(timer_count++, w);
+	coro_timer_sift_up(w->heap_index);
+	return 0;
+}
+
+static void
+coro_timer_delete(struct coro_io_wait *w)
+{
+	size_t index = w->heap_index;
+	w->heap_index = SIZE_MAX;
+	if (--timer_count == index)
+		return;
+	struct coro_io_wait *moved = timer_heap[timer_count];
+	coro_timer_set(index, moved);
+	coro_timer_sift_down(index);
+	coro_timer_sift_up(moved->heap_index);
+}
+
+static void
+coro_io_wait_create(struct coro_io_wait *w)
+{
+	w->coro = coro_this();
+	w->fd = -1;
+	w->deadline = -1;
+	w->heap_index = SIZE_MAX;
+	w->revents = 0;
+	w->is_woken = false;
+	w->is_cancelled = false;
+	w->cancels = &io_cancels;
+	w->next_cancelled = NULL;
+	w->is_listed = false;
+	w->is_cancel_sent = false;
+}
+
+/** Take the wait out of the timers and the epoll. */
+static void
+coro_io_wait_delete(struct coro_io_wait *w)
+{
+	if (w->heap_index != SIZE_MAX)
+		coro_timer_delete(w);
+	if (w->fd >= 0) {
+		epoll_ctl(io_epoll, EPOLL_CTL_DEL, w->fd, NULL);
+		--fd_waiter_count;
+	}
+}
+
+static void
+coro_io_wakeup(struct coro_io_wait *w, int revents)
+{
+	if (w->is_woken)
+		return;
+	w->is_woken = true;
+	w->revents = revents;
+	/*
+	 * Unregister right here, not in the woken coroutine. It
+	 * can be stolen by another thread, and the epoll should
+	 * not return a pointer to its wait object after that.
+	 */
+	coro_io_wait_delete(w);
+	coro_wakeup(w->coro);
+}
+
+/** Wake up the waits, cancelled from other threads. */
+static void
+coro_io_process_cancels(void)
+{
+	pthread_mutex_lock(&io_cancels.lock);
+	while (io_cancels.first != NULL) {
+		struct coro_io_wait *w = io_cancels.first;
+		io_cancels.first = w->next_cancelled;
+		w->is_listed = false;
+		if (! w->is_woken) {
+			w->is_cancelled = true;
+			coro_io_wakeup(w, 0);
+		}
+	}
+	pthread_mutex_unlock(&io_cancels.lock);
+}
+
+/** Wake up a wait of a cancelled coroutine, see coro_cancel(). */
+static bool
+coro_io_wait_cancel(void *arg)
+{
+	struct coro_io_wait *w = arg;
+	if (w->cancels == &io_cancels) {
+		/* The owner thread. The coroutine is parked for sure. */
+		if (! w->is_woken) {
+			w->is_cancelled = true;
+			coro_io_wakeup(w, 0);
+		}
+		return true;
+	}
+	struct coro_io_cancel_list *list = w->cancels;
+	pthread_mutex_lock(&list->lock);
+	if (! w->is_listed) {
+		w->next_cancelled = list->first;
+		list->first = w;
+		w->is_listed = true;
+	}
+	int wakeup_fd = list->wakeup_fd;
+	pthread_mutex_unlock(&list->lock);
+	w->is_cancel_sent = true;
+	uint64_t one = 1;
+	if (wakeup_fd >= 0) {
+		ssize_t rc = write(wakeup_fd, &one, sizeof(one));
+		(void)rc;
+	}
+	return true;
+}
+
+/**
+ * Park until the wait is woken up. The wait should be in the
+ * timers and/or the epoll already.
+ * @retval -1 Cancelled. Errno is ECANCELED.
+ */
+static int
+coro_io_park(struct coro_io_wait *w)
+{
+	if (coro_wait_begin(coro_io_wait_cancel, w) != 0) {
+		coro_io_wait_delete(w);
+		return -1;
+	}
+	coro_park();
+	coro_wait_end();
+	if (w->is_cancel_sent) {
+		/*
+		 * Woken up otherwise before the owner thread has seen
+		 * the cancel. The wait object is leaving with the
+		 * stack frame, so it should not stay in the list.
+		 */
+		struct coro_io_cancel_list *list = w->cancels;
+		pthread_mutex_lock(&list->lock);
+		if (w->is_listed) {
+			struct coro_io_wait **link = &list->first;
+			while (*link != w)
+				link = &(*link)->next_cancelled;
+			*link = w->next_cancelled;
+			w->is_listed = false;
+		}
+		pthread_mutex_unlock(&list->lock);
+	}
+	if (w->is_cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+/** Create the epoll set, if it is not done yet. */
+static int
+coro_io_epoll_create(void)
+{
+	if (io_epoll >= 0)
+		return 0;
+	io_epoll = epoll_create1(EPOLL_CLOEXEC);
+	return io_epoll < 0 ? -1 : 0;
+}
+
+int
+coro_io_thread_init(int wakeup_fd)
+{
+	if (coro_io_epoll_create() != 0)
+		return -1;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, wakeup_fd, &ev) != 0)
+		return -1;
+	/* Other threads read it to interrupt the poll. */
+	pthread_mutex_lock(&io_cancels.lock);
+	io_cancels.wakeup_fd = wakeup_fd;
+	pthread_mutex_unlock(&io_cancels.lock);
+	return 0;
+}
+
+void
+coro_io_thread_destroy(void)
+{
+	if (io_epoll >= 0)
+		close(io_epoll);
+	io_epoll = -1;
+	pthread_mutex_lock(&io_cancels.lock);
+	io_cancels.wakeup_fd = -1;
+	pthread_mutex_unlock(&io_cancels.lock);
+	free(timer_heap);
+	timer_heap = NULL;
+	timer_count = 0;
+	timer_capacity = 0;
+}
+
+bool
+coro_io_has_waiters(void)
+{
+	return fd_waiter_count > 0 || timer_count > 0;
+}
+
+void
+coro_io_poll(double timeout)
+{
+	int timeout_ms = 0;
+	if (timeout != 0) {
+		timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000) + 1;
+		if (timer_count > 0) {
+			double left = timer_heap[0]->deadline - coro_io_now();
+			int left_ms = left <= 0 ? 0 : (int)(left * 1000) + 1;
+			if (timeout_ms < 0 || left_ms < timeout_ms)
+				timeout_ms = left_ms;
+		}
+	}
+	if (fd_waiter_count > 0 || io_cancels.wakeup_fd >= 0) {
+		struct epoll_event events[CORO_IO_EVENT_BATCH];
+		int count = epoll_wait(io_epoll, events, CORO_IO_EVENT_BATCH,
+				       timeout_ms);
+		for (int i = 0; i < count; ++i) {
+			if (events[i].data.ptr == NULL) {
+				/* Just a wakeup. Reset the counter. */
+				uint64_t value;
+				ssize_t rc = read(io_cancels.wakeup_fd, &value,
+						  sizeof(value));
+				(void)rc;
+				continue;
+			}
+			int revents = 0;
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+				revents |= CORO_IO_READ;
+			if ((events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0)
+				revents |= CORO_IO_WRITE;
+			coro_io_wakeup(events[i].data.ptr, revents);
+		}
+	} else if (timeout_ms > 0) {
+		struct timespec ts;
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		nanosleep(&ts, NULL);
+	}
+	if (timer_count == 0) {
+		coro_io_process_cancels();
+		return;
+	}
+	double now = coro_io_now();
+	while (timer_count > 0 && timer_heap[0]->deadline <= now)
+		coro_io_wakeup(timer_heap[0], 0);
+	coro_io_process_cancels();
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	if (coro_io_epoll_create() != 0)
+		return -1;
+	struct coro_io_wait w;
+	coro_io_wait_create(&w);
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT;
+	if ((events & CORO_IO_READ) != 0)
+		ev.events |= EPOLLIN;
+	if ((events & CORO_IO_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = &w;
+	if (epoll_ctl(io_epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		if (errno != EPERM)
+			return -1;
+		/* A regular file. It is always ready. */
+		coro_yield();
+		return events;
+	}
+	w.fd = fd;
+	++fd_waiter_count;
+	if (timeout >= 0) {
+		w.deadline = coro_io_now() + timeout;
+		if (coro_timer_add(&w) != 0) {
+			coro_io_wait_delete(&w);
+			return -1;
+		}
+	}
+	if (coro_io_park(&w) != 0)
+		return -1;
+	return w.revents;
+}
+
+int
+coro_sleep(double timeout)
+{
+	struct coro_io_wait w;
+	coro_io_wait_create(&w);
+	w.deadline = coro_io_now() + timeout;
+	if (coro_timer_add(&w) != 0) {
+		/* No memory for the timer - at least let others run. */
+		coro_yield();
+		return 0;
+	}
+	return coro_io_park(&w);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0) {
+			/*
+			 * Data can be always ready, like in a regular
+			 * file. Give the others a chance anyway.
+			 */
+			coro_yield();
+			return rc;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (coro_wait_fd(fd, CORO_IO_READ, -1) < 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = write(fd, buf, size);
+		if (rc >= 0) {
+			coro_yield();
+			return rc;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (coro_wait_fd(fd, CORO_IO_WRITE, -1) < 0)
+			return -1;
+	}
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+	while (true) {
+		int rc = accept(fd, addr, addr_len);
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (coro_wait_fd(fd, CORO_IO_READ, -1) < 0)
+			return -1;
+	}
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+	if (connect(fd, addr, addr_len) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+	if (coro_wait_fd(fd, CORO_IO_WRITE, -1) < 0)
+		return -1;
+	int err;
+	socklen_t err_len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Blocking I/O for coroutines. Each call parks only the calling
+ * coroutine until its fd is ready, and the scheduler runs the
+ * others meanwhile. The fds should be in non-blocking mode.
+ *
+ * Regular files are always ready according to epoll, so for them
+ * the I/O is done right away. To let the others work between the
+ * chunks coro_read() and coro_write() yield after each successful
+ * call.
+ *
+ * Only one coroutine can wait for a given fd at a time.
+ *
+ * A wait of a coroutine, cancelled by coro_cancel(), is
+ * interrupted: the call fails with errno ECANCELED.
+ */
+
+enum coro_io_events {
+	CORO_IO_READ = 1,
+	CORO_IO_WRITE = 2,
+};
+
+/**
+ * Wait until @a fd is ready for any of @a events. Negative
+ * @a timeout means infinity.
+ * @retval >0 Mask of ready events.
+ * @retval 0 Timeout.
+ * @retval -1 Error. Check errno.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
+/**
+ * Sleep for @a timeout seconds, letting others work.
+ * @retval -1 Cancelled before the time. Errno is ECANCELED.
+ */
+int
+coro_sleep(double timeout);
+
+/** Same as read(), but waits for data in a coroutine way. */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Same as write(), but waits for space in a coroutine way. */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** Same as accept(), but waits for a client in a coroutine way. */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+/**
+ * Same as connect() on a non-blocking socket, but waits for the
+ * connection to be established.
+ */
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_len);
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "coro_local.h"
+#include "libcoro.h"
+#include "libcoro_impl.h"
+
+enum {
+	/** Size of the first arena chunk. */
+	CORO_ARENA_CHUNK_MIN = 4 * 1024,
+	/** Chunks grow twice until this size. */
+	CORO_ARENA_CHUNK_MAX = 64 * 1024,
+	/** Rounds of destructor calls, like in pthread. */
+	CORO_KEY_DESTRUCTOR_ITERATIONS = 4,
+};
+
+struct coro_arena_chunk {
+	/** Previously filled chunk. */
+	struct coro_arena_chunk *prev;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+/**
+ * A key slot. Each creation of a key in the slot increments its
+ * sequence number, so it is odd while the key exists. Values,
+ * stored under an older number, belong to a deleted key and are
+ * ignored. The same trick as in glibc's pthread_key_t.
+ */
+struct coro_key {
+	_Atomic uint64_t seq;
+	void (*destructor)(void *);
+};
+
+struct coro_key_value {
+	uint64_t seq;
+	void *value;
+};
+
+static struct coro_key coro_keys[CORO_KEYS_MAX];
+static pthread_mutex_t coro_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool
+coro_key_seq_is_used(uint64_t seq)
+{
+	return (seq & 1) != 0;
+}
+
+void
+coro_local_create(struct coro_local *l)
+{
+	l->chunk = NULL;
+	l->arena_used = 0;
+	l->values = NULL;
+	l->value_count = 0;
+}
+
+void
+coro_local_finish(struct coro_local *l)
+{
+	/* A destructor can set new values, then they are destroyed too. */
+	for (int i = 0; i < CORO_KEY_DESTRUCTOR_ITERATIONS; ++i) {
+		bool is_called = false;
+		for (unsigned key = 0; key < l->value_count; ++key) {
+			struct coro_key_value *v = &l->values[key];
+			if (v->value == NULL)
+				continue;
+			void *value = v->value;
+			v->value = NULL;
+			uint64_t seq = atomic_load_explicit(&coro_keys[key].seq,
+							    memory_order_acquire);
+			void (*destructor)(void *) = coro_keys[key].destructor;
+			if (seq != v->seq || destructor == NULL)
+				continue;
+			destructor(value);
+			is_called = true;
+		}
+		if (! is_called)
+			break;
+	}
+}
+
+void
+coro_local_destroy(struct coro_local *l)
+{
+	struct coro_arena_chunk *chunk = l->chunk;
+	while (chunk != NULL) {
+		struct coro_arena_chunk *prev = chunk->prev;
+		free(chunk);
+		chunk = prev;
+	}
+	free(l->values);
+	coro_local_create(l);
+}
+
+/**
+ * Allocate a chunk with at least @a size free bytes. Small chunks
+ * become the current one, a dedicated chunk for a big allocation
+ * is hidden behind the current one, so its free space is not lost.
+ */
+static struct coro_arena_chunk *
+coro_arena_chunk_new(struct coro_local *l, size_t size)
+{
+	size_t chunk_size = CORO_ARENA_CHUNK_MIN;
+	if (l->chunk != NULL)
+		chunk_size = l->chunk->size * 2;
+	if (chunk_size > CORO_ARENA_CHUNK_MAX)
+		chunk_size = CORO_ARENA_CHUNK_MAX;
+	bool is_dedicated = size > chunk_size / 2;
+	if (is_dedicated)
+		chunk_size = size;
+	struct coro_arena_chunk *chunk =
+		malloc(sizeof(*chunk) + chunk_size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = chunk_size;
+	chunk->used = 0;
+	if (is_dedicated && l->chunk != NULL) {
+		chunk->prev = l->chunk->prev;
+		l->chunk->prev = chunk;
+	} else {
+		chunk->prev = l->chunk;
+		l->chunk = chunk;
+	}
+	return chunk;
+}
+
+void *
+coro_alloc(size_t size)
+{
+	struct coro_local *l = coro_local(coro_this());
+	const size_t align = alignof(max_align_t);
+	if (size == 0)
+		size = 1;
+	if (size > SIZE_MAX - align) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = (size + align - 1) & ~(align - 1);
+	struct coro_arena_chunk *chunk = l->chunk;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = coro_arena_chunk_new(l, size);
+		if (chunk == NULL)
+			return NULL;
+	}
+	void *result = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	l->arena_used += size;
+	return result;
+}
+
+size_t
+coro_arena_used(void)
+{
+	return coro_local(coro_this())->arena_used;
+}
+
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *))
+{
+	pthread_mutex_lock(&coro_keys_lock);
+	for (unsigned i = 0; i < CORO_KEYS_MAX; ++i) {
+		uint64_t seq = atomic_load_explicit(&coro_keys[i].seq,
+						    memory_order_relaxed);
+		if (coro_key_seq_is_used(seq))
+			continue;
+		coro_keys[i].destructor = destructor;
+		atomic_store_explicit(&coro_keys[i].seq, seq + 1,
+				      memory_order_release);
+		pthread_mutex_unlock(&coro_keys_lock);
+		*key = i;
+		return 0;
+	}
+	pthread_mutex_unlock(&coro_keys_lock);
+	errno = EAGAIN;
+	return -1;
+}
+
+void
+coro_key_delete(coro_key_t key)
+{
+	if (key >= CORO_KEYS_MAX)
+		return;
+	pthread_mutex_lock(&coro_keys_lock);
+	uint64_t seq = atomic_load_explicit(&coro_keys[key].seq,
+					    memory_order_relaxed);
+	if (coro_key_seq_is_used(seq))
+		atomic_store_explicit(&coro_keys[key].seq, seq + 1,
+				      memory_order_release);
+	pthread_mutex_unlock(&coro_keys_lock);
+}
+
+int
+coro_key_set(coro_key_t key, void *value)
+{
+	if (key >= CORO_KEYS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t seq = atomic_load_explicit(&coro_keys[key].seq,
+					    memory_order_acquire);
+	if (! coro_key_seq_is_used(seq)) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct coro_local *l = coro_local(coro_this());
+	if (key >= l->value_count) {
+		/* Keys are usually few, grow in small steps. */
+		unsigned count = (key / 8 + 1) * 8;
+		struct coro_key_value *values =
+			realloc(l->values, count * sizeof(*values));
+		if (values == NULL)
+			return -1;
+		for (unsigned i = l->value_count; i < count; ++i) {
+			values[i].seq = 0;
+			values[i].value = NULL;
+		}
+		l->values = values;
+		l->value_count = count;
+	}
+	l->values[key].seq = seq;
+	l->values[key].value = value;
+	return 0;
+}
+
+void *
+coro_key_get(coro_key_t key)
+{
+	struct coro_local *l = coro_local(coro_this());
+	if (key >= l->value_count)
+		return NULL;
+	struct coro_key_value *v = &l->values[key];
+	if (v->seq != atomic_load_explicit(&coro_keys[key].seq,
+					   memory_order_acquire))
+		return NULL;
+	return v->value;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Memory and data, which belong to the current coroutine.
+ *
+ * The arena serves many small short-lived allocations without
+ * malloc: memory is cut from big chunks and is never freed one by
+ * one. All of it is released at once by coro_delete().
+ *
+ * Keys work like pthread_key_t, but the values are per coroutine,
+ * not per thread. Thread-local variables don't suit coroutines,
+ * which can move between threads.
+ */
+
+/**
+ * Allocate @a size bytes in the arena of the current coroutine.
+ * The memory is aligned like the one of malloc(). It is valid until
+ * the coroutine is deleted.
+ * @retval NULL No memory.
+ */
+void *
+coro_alloc(size_t size);
+
+/** Bytes allocated by the arena of the current coroutine. */
+size_t
+coro_arena_used(void);
+
+enum {
+	/** Max number of keys existing at once. */
+	CORO_KEYS_MAX = 128,
+};
+
+typedef unsigned coro_key_t;
+
+/**
+ * Create a key. The value for it is NULL in each coroutine. When a
+ * coroutine finishes, @a destructor is called for its non-NULL
+ * value, if the destructor is not NULL.
+ * @retval -1 Too many keys, errno is EAGAIN.
+ */
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *));
+
+/**
+ * Delete the key. Destructors are not called, the values are
+ * forgotten. The key can be reused by coro_key_create().
+ */
+void
+coro_key_delete(coro_key_t key);
+
+/**
+ * Set the value of the key for the current coroutine.
+ * @retval -1 No memory or invalid key.
+ */
+int
+coro_key_set(coro_key_t key, void *value);
+
+/** Get the value of the key for the current coroutine. */
+void *
+coro_key_get(coro_key_t key);
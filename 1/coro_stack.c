@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "coro_stack.h"
+#include "libcoro.h"
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+enum {
+	/** Size classes are 2^0 .. 2^(N-1) pages. */
+	CORO_STACK_CLASS_COUNT = 32,
+	/** How many free stacks of each size to keep for reuse. */
+	CORO_STACK_CACHE_MAX = 1024,
+	/** Min reserve above the max usage in the adaptive mode. */
+	CORO_STACK_MARGIN_MIN = 16 * 1024,
+};
+
+/** Fills the free stack memory to find the high-water mark. */
+static const uint64_t CORO_STACK_CANARY = 0xdeadbeefcafebabeULL;
+
+/** Free list of stacks of one size class. */
+struct coro_stack_cache {
+	struct coro_stack *first;
+	size_t count;
+};
+
+static struct coro_stack_cache stack_cache[CORO_STACK_CLASS_COUNT];
+/** List of all mapped stacks, used and cached, for stats. */
+static struct coro_stack *stack_list = NULL;
+static size_t stack_used_count = 0;
+static size_t stack_cached_count = 0;
+static size_t page_size = 0;
+/** Coroutines are created and deleted by many threads. */
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum coro_stack_check stack_check = CORO_STACK_CHECK_OFF;
+/** Usage per entry function. There are usually a few of them. */
+static struct coro_stack_usage *stack_usages = NULL;
+static size_t stack_usage_count = 0;
+static size_t stack_usage_capacity = 0;
+static pthread_mutex_t stack_usage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+coro_page_size(void)
+{
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/** Smallest class, which can fit @a size bytes. -1 if too big. */
+static int
+coro_stack_size_class(size_t size)
+{
+	size_t pages = (size + coro_page_size() - 1) / coro_page_size();
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		if (((size_t)1 << i) >= pages)
+			return i;
+	}
+	return -1;
+}
+
+struct coro_stack *
+coro_stack_new(size_t size)
+{
+	int size_class = coro_stack_size_class(size);
+	if (size_class < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_mutex_lock(&stack_lock);
+	struct coro_stack_cache *cache = &stack_cache[size_class];
+	struct coro_stack *stack = cache->first;
+	if (stack != NULL) {
+		cache->first = stack->next_free;
+		--cache->count;
+		--stack_cached_count;
+		++stack_used_count;
+		pthread_mutex_unlock(&stack_lock);
+		return stack;
+	}
+	stack = malloc(sizeof(*stack));
+	if (stack == NULL) {
+		pthread_mutex_unlock(&stack_lock);
+		return NULL;
+	}
+	size_t guard = coro_page_size();
+	size = ((size_t)1 << size_class) * coro_page_size();
+	/*
+	 * MAP_NORESERVE - the memory is committed only when
+	 * touched, so a big virtual stack costs only the pages
+	 * which the coroutine really uses.
+	 */
+	char *map = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			 MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		goto error;
+	/*
+	 * Stack grows down, so an overflow hits the lowest page.
+	 * Each guarded stack takes 2 mappings, which counts
+	 * against vm.max_map_count.
+	 */
+	if (mprotect(map, guard, PROT_NONE) != 0) {
+		int errsv = errno;
+		munmap(map, guard + size);
+		errno = errsv;
+		goto error;
+	}
+	stack->base = map + guard;
+	stack->size = size;
+	stack->size_class = size_class;
+	stack->is_painted = false;
+	stack->dirty_size = size;
+	stack->next_free = NULL;
+	stack->prev = NULL;
+	stack->next = stack_list;
+	if (stack_list != NULL)
+		stack_list->prev = stack;
+	stack_list = stack;
+	++stack_used_count;
+	pthread_mutex_unlock(&stack_lock);
+	return stack;
+error:
+	pthread_mutex_unlock(&stack_lock);
+	free(stack);
+	return NULL;
+}
+
+void
+coro_stack_delete(struct coro_stack *stack)
+{
+	pthread_mutex_lock(&stack_lock);
+	--stack_used_count;
+	struct coro_stack_cache *cache = &stack_cache[stack->size_class];
+	if (cache->count < CORO_STACK_CACHE_MAX) {
+		stack->next_free = cache->first;
+		cache->first = stack;
+		++cache->count;
+		++stack_cached_count;
+		pthread_mutex_unlock(&stack_lock);
+		return;
+	}
+	if (stack->prev != NULL)
+		stack->prev->next = stack->next;
+	else
+		stack_list = stack->next;
+	if (stack->next != NULL)
+		stack->next->prev = stack->prev;
+	pthread_mutex_unlock(&stack_lock);
+	size_t guard = coro_page_size();
+	munmap(stack->base - guard, guard + stack->size);
+	free(stack);
+}
+
+void
+coro_stack_stats(struct coro_stack_stats *stats)
+{
+	pthread_mutex_lock(&stack_lock);
+	stats->used_count = stack_used_count;
+	stats->cached_count = stack_cached_count;
+	stats->virtual_size = 0;
+	stats->resident_size = 0;
+	size_t page = coro_page_size();
+	unsigned char *vec = NULL;
+	size_t vec_size = 0;
+	for (struct coro_stack *s = stack_list; s != NULL; s = s->next) {
+		stats->virtual_size += s->size + page;
+		size_t pages = s->size / page;
+		if (pages > vec_size) {
+			unsigned char *new_vec = realloc(vec, pages);
+			if (new_vec == NULL)
+				continue;
+			vec = new_vec;
+			vec_size = pages;
+		}
+		if (mincore(s->base, s->size, vec) != 0)
+			continue;
+		for (size_t i = 0; i < pages; ++i) {
+			if ((vec[i] & 1) != 0)
+				stats->resident_size += page;
+		}
+	}
+	pthread_mutex_unlock(&stack_lock);
+	free(vec);
+}
+
+void
+coro_stack_paint(struct coro_stack *stack)
+{
+	if (! stack->is_painted)
+		stack->dirty_size = stack->size;
+	uint64_t *end = (uint64_t *)(stack->base + stack->size);
+	uint64_t *word = end - (stack->dirty_size + 7) / 8;
+	while (word < end)
+		*word++ = CORO_STACK_CANARY;
+	stack->is_painted = true;
+	stack->dirty_size = 0;
+}
+
+size_t
+coro_stack_measure(struct coro_stack *stack)
+{
+	uint64_t *word = (uint64_t *)stack->base;
+	uint64_t *end = (uint64_t *)(stack->base + stack->size);
+	while (word < end && *word == CORO_STACK_CANARY)
+		++word;
+	stack->dirty_size = (char *)end - (char *)word;
+	return stack->dirty_size;
+}
+
+void
+coro_stack_check_set(enum coro_stack_check mode)
+{
+	stack_check = mode;
+}
+
+enum coro_stack_check
+coro_stack_check_get(void)
+{
+	return stack_check;
+}
+
+static size_t
+coro_stack_adaptive_size(const struct coro_stack_usage *usage)
+{
+	size_t margin = usage->max_used / 2;
+	if (margin < CORO_STACK_MARGIN_MIN)
+		margin = CORO_STACK_MARGIN_MIN;
+	return usage->max_used + margin;
+}
+
+/** Find the usage of the function. NULL, if not measured yet. */
+static struct coro_stack_usage *
+coro_stack_usage_find(coro_f func)
+{
+	for (size_t i = 0; i < stack_usage_count; ++i) {
+		if (stack_usages[i].func == func)
+			return &stack_usages[i];
+	}
+	return NULL;
+}
+
+void
+coro_stack_usage_add(coro_f func, size_t used)
+{
+	pthread_mutex_lock(&stack_usage_lock);
+	struct coro_stack_usage *usage = coro_stack_usage_find(func);
+	if (usage == NULL) {
+		if (stack_usage_count == stack_usage_capacity) {
+			size_t capacity = stack_usage_capacity == 0 ?
+					  8 : stack_usage_capacity * 2;
+			struct coro_stack_usage *usages = realloc(
+				stack_usages, capacity * sizeof(*usages));
+			if (usages == NULL) {
+				/* Just not accounted. */
+				pthread_mutex_unlock(&stack_usage_lock);
+				return;
+			}
+			stack_usages = usages;
+			stack_usage_capacity = capacity;
+		}
+		usage = &stack_usages[stack_usage_count++];
+		usage->func = func;
+		usage->count = 0;
+		usage->max_used = 0;
+		usage->total_used = 0;
+	}
+	++usage->count;
+	usage->total_used += used;
+	if (used > usage->max_used)
+		usage->max_used = used;
+	usage->adaptive_size = coro_stack_adaptive_size(usage);
+	pthread_mutex_unlock(&stack_usage_lock);
+}
+
+size_t
+coro_stack_size_for(coro_f func, size_t size)
+{
+	if (stack_check != CORO_STACK_CHECK_ADAPTIVE)
+		return size;
+	pthread_mutex_lock(&stack_usage_lock);
+	struct coro_stack_usage *usage = coro_stack_usage_find(func);
+	if (usage != NULL && usage->adaptive_size < size)
+		size = usage->adaptive_size;
+	pthread_mutex_unlock(&stack_usage_lock);
+	return size;
+}
+
+size_t
+coro_stack_usage(struct coro_stack_usage *usage, size_t count)
+{
+	pthread_mutex_lock(&stack_usage_lock);
+	for (size_t i = 0; i < count && i < stack_usage_count; ++i)
+		usage[i] = stack_usages[i];
+	count = stack_usage_count;
+	pthread_mutex_unlock(&stack_usage_lock);
+	return count;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "libcoro.h"
+
+/**
+ * Coroutine stack. The memory is mapped with a PROT_NONE guard
+ * page below the usable area so as a stack overflow crashes
+ * instead of silently corrupting a neighbour. Pages are committed
+ * lazily, when touched.
+ */
+struct coro_stack {
+	/** Usable stack memory: [base, base + size). */
+	char *base;
+	/** Usable size, excluding the guard page. */
+	size_t size;
+	/** Index of the size class, used to find a free list. */
+	int size_class;
+	/** True, if the free part is filled with the canary. */
+	bool is_painted;
+	/**
+	 * Bytes at the top, which can differ from the canary. The
+	 * rest is painted already, when the stack is reused.
+	 */
+	size_t dirty_size;
+	/** Link in a free list, when cached. */
+	struct coro_stack *next_free;
+	/** Links in the list of all the stacks. */
+	struct coro_stack *next, *prev;
+};
+
+/**
+ * Get a stack at least @a size bytes big. It is either taken from
+ * the cache or mapped. The size is rounded up to a power of 2
+ * pages.
+ * @retval NULL Memory error. Check errno.
+ */
+struct coro_stack *
+coro_stack_new(size_t size);
+
+/**
+ * Return the stack into the cache, or unmap it if the cache is
+ * full.
+ */
+void
+coro_stack_delete(struct coro_stack *stack);
+
+/**
+ * Fill the stack with the canary pattern, so as its usage can be
+ * measured later. Only the part, used since the last painting, is
+ * filled again.
+ */
+void
+coro_stack_paint(struct coro_stack *stack);
+
+/**
+ * High-water mark of a painted stack: bytes from the top to the
+ * deepest one, which is not the canary anymore.
+ */
+size_t
+coro_stack_measure(struct coro_stack *stack);
+
+/** Account a measured stack of a coroutine with the entry @a func. */
+void
+coro_stack_usage_add(coro_f func, size_t used);
+
+/**
+ * Stack size for a new coroutine with the entry @a func. In the
+ * adaptive mode, when there are measurements for @a func, it is
+ * the max usage plus a margin, but not more than @a size.
+ * Otherwise it is @a size.
+ */
+size_t
+coro_stack_size_for(coro_f func, size_t size);
+
+/** Current mode, see coro_stack_check_set(). */
+enum coro_stack_check
+coro_stack_check_get(void);
@@ -0,0 +1,405 @@
+#include <errno.h>
+#include <stdlib.h>
+#include "coro_sync.h"
+#include "libcoro.h"
+#include "libcoro_impl.h"
+
+/** A blocked coroutine. Lives on its stack while it waits. */
+struct coro_waiter {
+	struct coro *coro;
+	struct coro_waiter *next;
+	/** The queue and the lock of the object, for a cancel. */
+	struct coro_wait_queue *queue;
+	pthread_mutex_t *lock;
+	/** False, when dequeued by a waker or by a cancel. */
+	bool is_queued;
+	/** True, if woken up by coro_cancel(). */
+	bool is_cancelled;
+};
+
+static void
+coro_wait_queue_create(struct coro_wait_queue *q)
+{
+	q->first = NULL;
+	q->last = NULL;
+}
+
+/** Take a waiter out of the queue, wherever it is. */
+static void
+coro_wait_queue_delete(struct coro_wait_queue *q, struct coro_waiter *w)
+{
+	struct coro_waiter *prev = NULL;
+	struct coro_waiter **link = &q->first;
+	while (*link != w) {
+		prev = *link;
+		link = &prev->next;
+	}
+	*link = w->next;
+	if (q->last == w)
+		q->last = prev;
+	w->is_queued = false;
+}
+
+/** Wake up a waiter of a cancelled coroutine, see coro_cancel(). */
+static bool
+coro_waiter_cancel(void *arg)
+{
+	struct coro_waiter *w = arg;
+	/* The waiting side takes the wait lock under this one. */
+	if (pthread_mutex_trylock(w->lock) != 0)
+		return false;
+	/* Otherwise a waker was first, and it is woken up already. */
+	if (w->is_queued) {
+		coro_wait_queue_delete(w->queue, w);
+		w->is_cancelled = true;
+		coro_wakeup(w->coro);
+	}
+	pthread_mutex_unlock(w->lock);
+	return true;
+}
+
+/**
+ * Block the current coroutine in the queue. The object's @a lock
+ * should be locked. It is unlocked while the coroutine waits and
+ * is locked again on return.
+ * @retval -1 The coroutine is cancelled, the waited event has not
+ *         happened. Errno is ECANCELED.
+ */
+static int
+coro_wait_queue_wait(struct coro_wait_queue *q, pthread_mutex_t *lock)
+{
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.next = NULL;
+	w.queue = q;
+	w.lock = lock;
+	w.is_queued = true;
+	w.is_cancelled = false;
+	if (coro_wait_begin(coro_waiter_cancel, &w) != 0)
+		return -1;
+	if (q->last != NULL)
+		q->last->next = &w;
+	else
+		q->first = &w;
+	q->last = &w;
+	/* The waker dequeues the waiter, it is not here anymore. */
+	coro_park_unlock(lock);
+	coro_wait_end();
+	pthread_mutex_lock(lock);
+	if (w.is_cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Wake up the first waiter, if any. The object's lock should be
+ * locked.
+ * @retval true Somebody is woken up.
+ */
+static bool
+coro_wait_queue_wakeup_first(struct coro_wait_queue *q)
+{
+	struct coro_waiter *w = q->first;
+	if (w == NULL)
+		return false;
+	q->first = w->next;
+	if (q->first == NULL)
+		q->last = NULL;
+	w->is_queued = false;
+	coro_wakeup(w->coro);
+	return true;
+}
+
+static void
+coro_wait_queue_wakeup_all(struct coro_wait_queue *q)
+{
+	while (coro_wait_queue_wakeup_first(q))
+		;
+}
+
+void
+coro_mutex_create(struct coro_mutex *m)
+{
+	pthread_mutex_init(&m->lock, NULL);
+	m->is_locked = false;
+	coro_wait_queue_create(&m->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *m)
+{
+	pthread_mutex_destroy(&m->lock);
+}
+
+int
+coro_mutex_lock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	if (! m->is_locked) {
+		m->is_locked = true;
+		pthread_mutex_unlock(&m->lock);
+		return 0;
+	}
+	/*
+	 * The unlocker does not release the mutex when there are
+	 * waiters, but hands it over. So on wakeup it is ours. A
+	 * cancelled waiter is dequeued before a hand-over.
+	 */
+	int rc = coro_wait_queue_wait(&m->waiters, &m->lock);
+	pthread_mutex_unlock(&m->lock);
+	if (rc != 0)
+		errno = ECANCELED;
+	return rc;
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	bool is_taken = ! m->is_locked;
+	m->is_locked = true;
+	pthread_mutex_unlock(&m->lock);
+	return is_taken;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	if (! coro_wait_queue_wakeup_first(&m->waiters))
+		m->is_locked = false;
+	pthread_mutex_unlock(&m->lock);
+}
+
+void
+coro_cond_create(struct coro_cond *c)
+{
+	pthread_mutex_init(&c->lock, NULL);
+	coro_wait_queue_create(&c->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *c)
+{
+	pthread_mutex_destroy(&c->lock);
+}
+
+int
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	/*
+	 * Get into the queue before the mutex is unlocked. Then a
+	 * signal, sent right after the unlock, is not lost.
+	 */
+	pthread_mutex_lock(&c->lock);
+	coro_mutex_unlock(m);
+	int rc = coro_wait_queue_wait(&c->waiters, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+	/* Like in pthread, the mutex is locked even when cancelled. */
+	bool is_cancellable = coro_set_cancellable(false);
+	coro_mutex_lock(m);
+	coro_set_cancellable(is_cancellable);
+	if (rc != 0)
+		errno = ECANCELED;
+	return rc;
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	coro_wait_queue_wakeup_first(&c->waiters);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	coro_wait_queue_wakeup_all(&c->waiters);
+	pthread_mutex_unlock(&c->lock);
+}
+
+int
+coro_channel_create(struct coro_channel *ch, size_t capacity)
+{
+	if (capacity == 0)
+		capacity = 1;
+	ch->data = malloc(capacity * sizeof(*ch->data));
+	if (ch->data == NULL)
+		return -1;
+	pthread_mutex_init(&ch->lock, NULL);
+	ch->capacity = capacity;
+	ch->head = 0;
+	ch->count = 0;
+	ch->is_closed = false;
+	coro_wait_queue_create(&ch->senders);
+	coro_wait_queue_create(&ch->receivers);
+	return 0;
+}
+
+void
+coro_channel_destroy(struct coro_channel *ch)
+{
+	pthread_mutex_destroy(&ch->lock);
+	free(ch->data);
+	ch->data = NULL;
+}
+
+int
+coro_channel_send(struct coro_channel *ch, void *value)
+{
+	pthread_mutex_lock(&ch->lock);
+	while (ch->count == ch->capacity && ! ch->is_closed) {
+		if (coro_wait_queue_wait(&ch->senders, &ch->lock) != 0) {
+			pthread_mutex_unlock(&ch->lock);
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	ch->data[(ch->head + ch->count) % ch->capacity] = value;
+	++ch->count;
+	coro_wait_queue_wakeup_first(&ch->receivers);
+	pthread_mutex_unlock(&ch->lock);
+	return 0;
+}
+
+int
+coro_channel_recv(struct coro_channel *ch, void **value)
+{
+	pthread_mutex_lock(&ch->lock);
+	while (ch->count == 0 && ! ch->is_closed) {
+		if (coro_wait_queue_wait(&ch->receivers, &ch->lock) != 0) {
+			pthread_mutex_unlock(&ch->lock);
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+	if (ch->count == 0) {
+		pthread_mutex_unlock(&ch->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	*value = ch->data[ch->head];
+	ch->head = (ch->head + 1) % ch->capacity;
+	--ch->count;
+	coro_wait_queue_wakeup_first(&ch->senders);
+	pthread_mutex_unlock(&ch->lock);
+	return 0;
+}
+
+void
+coro_channel_close(struct coro_channel *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->is_closed = true;
+	coro_wait_queue_wakeup_all(&ch->senders);
+	coro_wait_queue_wakeup_all(&ch->receivers);
+	pthread_mutex_unlock(&ch->lock);
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *wg)
+{
+	pthread_mutex_init(&wg->lock, NULL);
+	wg->count = 0;
+	coro_wait_queue_create(&wg->waiters);
+}
+
+void
+coro_wait_group_destroy(struct coro_wait_group *wg)
+{
+	pthread_mutex_destroy(&wg->lock);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, long count)
+{
+	pthread_mutex_lock(&wg->lock);
+	wg->count += count;
+	if (wg->count <= 0)
+		coro_wait_queue_wakeup_all(&wg->waiters);
+	pthread_mutex_unlock(&wg->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+int
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	int rc = 0;
+	pthread_mutex_lock(&wg->lock);
+	while (wg->count > 0 && rc == 0)
+		rc = coro_wait_queue_wait(&wg->waiters, &wg->lock);
+	pthread_mutex_unlock(&wg->lock);
+	if (rc != 0)
+		errno = ECANCELED;
+	return rc;
+}
+
+void
+coro_future_create(struct coro_future *f)
+{
+	pthread_mutex_init(&f->lock, NULL);
+	f->is_ready = false;
+	f->value = NULL;
+	coro_wait_queue_create(&f->waiters);
+}
+
+void
+coro_future_destroy(struct coro_future *f)
+{
+	pthread_mutex_destroy(&f->lock);
+}
+
+int
+coro_future_set(struct coro_future *f, void *value)
+{
+	pthread_mutex_lock(&f->lock);
+	if (f->is_ready) {
+		pthread_mutex_unlock(&f->lock);
+		errno = EINVAL;
+		return -1;
+	}
+	f->is_ready = true;
+	f->value = value;
+	coro_wait_queue_wakeup_all(&f->waiters);
+	pthread_mutex_unlock(&f->lock);
+	return 0;
+}
+
+bool
+coro_future_is_ready(struct coro_future *f)
+{
+	pthread_mutex_lock(&f->lock);
+	bool is_ready = f->is_ready;
+	pthread_mutex_unlock(&f->lock);
+	return is_ready;
+}
+
+void *
+coro_await(struct coro_future *f)
+{
+	pthread_mutex_lock(&f->lock);
+	while (! f->is_ready) {
+		if (coro_wait_queue_wait(&f->waiters, &f->lock) != 0) {
+			pthread_mutex_unlock(&f->lock);
+			errno = ECANCELED;
+			return NULL;
+		}
+	}
+	void *value = f->value;
+	pthread_mutex_unlock(&f->lock);
+	return value;
+}
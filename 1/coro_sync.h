@@ -0,0 +1,197 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Synchronization of coroutines. Blocking on any of these parks
+ * only the calling coroutine until another one wakes it up, no
+ * busy yields. They work in the multi-thread mode too, so each
+ * object has an internal lock, held only for a few instructions.
+ *
+ * The objects are embedded into the user's structures, like the
+ * pthread ones: create, use, destroy when nobody waits on them.
+ *
+ * A wait of a coroutine, cancelled by coro_cancel(), is
+ * interrupted: the call fails with errno ECANCELED without the
+ * waited event, and the coroutine can get to a cancellation point.
+ */
+
+struct coro_waiter;
+
+/** FIFO of coroutines, blocked on an object. */
+struct coro_wait_queue {
+	struct coro_waiter *first, *last;
+};
+
+struct coro_mutex {
+	pthread_mutex_t lock;
+	bool is_locked;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *m);
+
+void
+coro_mutex_destroy(struct coro_mutex *m);
+
+/**
+ * Lock the mutex. If it is locked already, the coroutine waits.
+ * The waiters get the mutex in the order they came.
+ * @retval -1 Cancelled, the mutex is not locked.
+ */
+int
+coro_mutex_lock(struct coro_mutex *m);
+
+/**
+ * Try to lock the mutex without waiting.
+ * @retval true Locked.
+ */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/** Unlock the mutex and hand it to the first waiter, if any. */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+struct coro_cond {
+	pthread_mutex_t lock;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *c);
+
+void
+coro_cond_destroy(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal and lock @a m again. Like with
+ * pthread, the condition should be checked in a loop.
+ * @retval -1 Cancelled. @a m is locked anyway.
+ */
+int
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up the first waiter. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/**
+ * Bounded FIFO of pointers. Senders wait when it is full,
+ * receivers wait when it is empty.
+ */
+struct coro_channel {
+	pthread_mutex_t lock;
+	/** Ring buffer of the values. */
+	void **data;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool is_closed;
+	struct coro_wait_queue senders;
+	struct coro_wait_queue receivers;
+};
+
+/**
+ * Create a channel of @a capacity values, at least 1.
+ * @retval -1 No memory.
+ */
+int
+coro_channel_create(struct coro_channel *ch, size_t capacity);
+
+void
+coro_channel_destroy(struct coro_channel *ch);
+
+/**
+ * Put a value into the channel. Waits while it is full.
+ * @retval -1 The channel is closed, errno is EPIPE. Or cancelled,
+ *         errno is ECANCELED.
+ */
+int
+coro_channel_send(struct coro_channel *ch, void *value);
+
+/**
+ * Take a value from the channel. Waits while it is empty.
+ * @retval -1 The channel is closed and empty, errno is EPIPE. Or
+ *         cancelled, errno is ECANCELED.
+ */
+int
+coro_channel_recv(struct coro_channel *ch, void **value);
+
+/**
+ * Forbid new sends. Receivers can take the values left, then
+ * they get errors. All the waiters are woken up.
+ */
+void
+coro_channel_close(struct coro_channel *ch);
+
+/** Waits until a counter of running jobs drops to zero. */
+struct coro_wait_group {
+	pthread_mutex_t lock;
+	long count;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *wg);
+
+void
+coro_wait_group_destroy(struct coro_wait_group *wg);
+
+/** Add @a count jobs, can be negative. */
+void
+coro_wait_group_add(struct coro_wait_group *wg, long count);
+
+/** One job is finished. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/**
+ * Wait until all the jobs are finished.
+ * @retval -1 Cancelled.
+ */
+int
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/**
+ * A value, which will be known later. Coroutines, awaiting it,
+ * wait until some other coroutine sets it. It is set once.
+ */
+struct coro_future {
+	pthread_mutex_t lock;
+	bool is_ready;
+	void *value;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_future_create(struct coro_future *f);
+
+void
+coro_future_destroy(struct coro_future *f);
+
+/**
+ * Set the value and wake up all the awaiting coroutines.
+ * @retval -1 It is set already, errno is EINVAL.
+ */
+int
+coro_future_set(struct coro_future *f, void *value);
+
+/** True, if the value is set. */
+bool
+coro_future_is_ready(struct coro_future *f);
+
+/**
+ * Wait until the value is set and return it.
+ * @retval NULL Cancelled, errno is ECANCELED. NULL can be a
+ *         value too, then check coro_future_is_ready().
+ */
+void *
+coro_await(struct coro_future *f);
@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "coro_io.h"
+#include "coro_sync.h"
+#include "libcoro.h"
+
+/*
+ * Cancellation of the parked coroutines: a sleeper, a receiver
+ * from an empty channel and a parent of a sleeping child should
+ * wake up, get to a cancellation point and be returned by the
+ * scheduler long before the sleep ends. Build it with 'make
+ * test_coro' to run it with both backends, in the single- and the
+ * multi-thread mode. An argument is the number of worker threads.
+ */
+
+enum {
+	/** Coroutines of each kind to cancel. */
+	TEST_PAIR_COUNT = 8,
+};
+
+/** The sleep, which should be interrupted. */
+static const double TEST_SLEEP = 10;
+
+struct test_ctx {
+	struct coro_channel channel;
+	struct coro *victims[TEST_PAIR_COUNT * 2 + 1];
+};
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+test_sleeper_f(void *arg)
+{
+	(void)arg;
+	if (coro_sleep(TEST_SLEEP) == 0 || errno != ECANCELED)
+		return 1;
+	coro_testcancel();
+	return 2;
+}
+
+static int
+test_receiver_f(void *arg)
+{
+	struct test_ctx *ctx = arg;
+	void *value;
+	if (coro_channel_recv(&ctx->channel, &value) == 0 ||
+	    errno != ECANCELED)
+		return 1;
+	coro_testcancel();
+	return 2;
+}
+
+/** The child is cancelled by the parent's cancel. */
+static int
+test_parent_f(void *arg)
+{
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.is_child = true;
+	if (coro_new_ex(test_sleeper_f, arg, &attr) == NULL)
+		return 1;
+	coro_wait_children();
+	coro_testcancel();
+	return 2;
+}
+
+/** Let the others park, then cancel them. */
+static int
+test_canceller_f(void *arg)
+{
+	struct test_ctx *ctx = arg;
+	coro_sleep(0.05);
+	for (int i = 0; i < TEST_PAIR_COUNT * 2 + 1; ++i) {
+		if (coro_cancel(ctx->victims[i]) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count = argc > 1 ? atoi(argv[1]) : 0;
+	if (thread_count > 0) {
+		if (coro_sched_init_threads(thread_count) != 0) {
+			perror("coro_sched_init_threads");
+			return 1;
+		}
+	} else {
+		coro_sched_init();
+	}
+	struct test_ctx ctx;
+	if (coro_channel_create(&ctx.channel, 1) != 0) {
+		perror("coro_channel_create");
+		return 1;
+	}
+	double start = test_now();
+	for (int i = 0; i < TEST_PAIR_COUNT; ++i) {
+		ctx.victims[i * 2] = coro_new(test_sleeper_f, &ctx);
+		ctx.victims[i * 2 + 1] = coro_new(test_receiver_f, &ctx);
+	}
+	ctx.victims[TEST_PAIR_COUNT * 2] = coro_new(test_parent_f, &ctx);
+	struct coro *canceller = coro_new(test_canceller_f, &ctx);
+	int rc = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		int expected = c == canceller ? 0 : -1;
+		if (coro_status(c) != expected) {
+			printf("Status %d instead of %d\n", coro_status(c),
+			       expected);
+			rc = 1;
+		}
+		coro_delete(c);
+	}
+	double duration = test_now() - start;
+	if (duration >= TEST_SLEEP / 2) {
+		printf("The sleepers were not woken up: %.2f s\n", duration);
+		rc = 1;
+	}
+	coro_channel_destroy(&ctx.channel);
+	coro_sched_destroy();
+	if (rc == 0)
+		printf("Cancellation is ok\n");
+	return rc;
+}
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coro_trace.h"
+#include "libcoro.h"
+#include "libcoro_impl.h"
+
+enum {
+	CORO_TRACE_CAPACITY_DEFAULT = 64 * 1024,
+	/** Histogram buckets per power of 2 are 1 << this. */
+	CORO_HISTOGRAM_SUB_BITS = 2,
+	CORO_HISTOGRAM_SUB_COUNT = 1 << CORO_HISTOGRAM_SUB_BITS,
+};
+
+/**
+ * A slot of the ring buffer. It is protected by a sequence lock:
+ * the writer of the event number N sets seq to 2N + 1 before
+ * filling the slot and to 2N + 2 after. A reader takes the event,
+ * only if seq is 2N + 2 before and after the copy.
+ */
+struct coro_trace_event {
+	_Atomic uint64_t seq;
+	uint64_t ticks;
+	uint64_t coro_id;
+	uint64_t arg;
+	uint32_t type;
+	uint32_t thread;
+};
+
+struct coro_trace {
+	struct coro_trace_event *events;
+	/** Capacity - 1, the capacity is a power of 2. */
+	uint64_t mask;
+	/** Number of events ever recorded. */
+	_Atomic uint64_t head;
+	/** Source of the coroutine ids. */
+	_Atomic uint64_t next_id;
+	double ns_per_tick;
+};
+
+atomic_bool coro_trace_is_on = false;
+static struct coro_trace trace;
+
+int
+coro_trace_start(size_t capacity)
+{
+	coro_trace_stop();
+	if (capacity == 0)
+		capacity = CORO_TRACE_CAPACITY_DEFAULT;
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	trace.events = calloc(size, sizeof(*trace.events));
+	if (trace.events == NULL)
+		return -1;
+	trace.mask = size - 1;
+	atomic_store(&trace.head, 0);
+	atomic_store(&trace.next_id, 1);
+	trace.ns_per_tick = 1e9 / coro_ticks_per_sec();
+	atomic_store(&coro_trace_is_on, true);
+	return 0;
+}
+
+void
+coro_trace_stop(void)
+{
+	atomic_store(&coro_trace_is_on, false);
+	free(trace.events);
+	trace.events = NULL;
+}
+
+uint64_t
+coro_trace_dropped(void)
+{
+	uint64_t head = atomic_load(&trace.head);
+	if (trace.events == NULL || head <= trace.mask + 1)
+		return 0;
+	return head - trace.mask - 1;
+}
+
+struct coro_trace_stats *
+coro_trace_stats_new(void)
+{
+	struct coro_trace_stats *stats = calloc(1, sizeof(*stats));
+	if (stats == NULL)
+		return NULL;
+	stats->id = atomic_fetch_add_explicit(&trace.next_id, 1,
+					      memory_order_relaxed);
+	return stats;
+}
+
+void
+coro_trace_record(enum coro_trace_event_type type, uint64_t ticks,
+		  unsigned thread, uint64_t coro_id, uint64_t arg)
+{
+	uint64_t pos = atomic_fetch_add_explicit(&trace.head, 1,
+						 memory_order_relaxed);
+	struct coro_trace_event *e = &trace.events[pos & trace.mask];
+	atomic_store_explicit(&e->seq, 2 * pos + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	e->ticks = ticks;
+	e->coro_id = coro_id;
+	e->arg = arg;
+	e->type = type;
+	e->thread = thread;
+	atomic_store_explicit(&e->seq, 2 * pos + 2, memory_order_release);
+}
+
+/** Copy the event number @a pos, if it is not overwritten yet. */
+static bool
+coro_trace_read(uint64_t pos, struct coro_trace_event *result)
+{
+	struct coro_trace_event *e = &trace.events[pos & trace.mask];
+	uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+	if (seq != 2 * pos + 2)
+		return false;
+	result->ticks = e->ticks;
+	result->coro_id = e->coro_id;
+	result->arg = e->arg;
+	result->type = e->type;
+	result->thread = e->thread;
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&e->seq, memory_order_relaxed) == seq;
+}
+
+static const char *coro_trace_event_names[] = {
+	[CORO_TRACE_CREATE] = "create",
+	[CORO_TRACE_SWITCH] = "switch",
+	[CORO_TRACE_FINISH] = "finish",
+	[CORO_TRACE_WAIT] = "wait",
+	[CORO_TRACE_WAKEUP] = "wakeup",
+};
+
+/** What runs on a thread since when, to make the slices. */
+struct coro_trace_thread {
+	bool is_known;
+	uint64_t coro_id;
+	uint64_t since;
+};
+
+static void
+coro_trace_print_slice(FILE *f, uint64_t coro_id, unsigned thread,
+		       uint64_t start, uint64_t end, uint64_t origin)
+{
+	double ts = (start - origin) * trace.ns_per_tick / 1000;
+	double dur = (end - start) * trace.ns_per_tick / 1000;
+	if (coro_id == 0) {
+		fprintf(f, ",\n{\"name\":\"scheduler\",\"cat\":\"sched\","
+			"\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+			"\"tid\":%u}", ts, dur, thread);
+		return;
+	}
+	fprintf(f, ",\n{\"name\":\"coro %llu\",\"cat\":\"coro\",\"ph\":\"X\","
+		"\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+		(unsigned long long)coro_id, ts, dur, thread);
+}
+
+int
+coro_trace_export(const char *path)
+{
+	if (trace.events == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t head = atomic_load(&trace.head);
+	uint64_t first = head > trace.mask + 1 ? head - trace.mask - 1 : 0;
+	struct coro_trace_event e;
+	uint64_t origin = 0;
+	unsigned thread_count = 0;
+	for (uint64_t pos = first; pos < head; ++pos) {
+		if (! coro_trace_read(pos, &e))
+			continue;
+		if (origin == 0 || e.ticks < origin)
+			origin = e.ticks;
+		if (e.thread >= thread_count)
+			thread_count = e.thread + 1;
+	}
+	struct coro_trace_thread *threads =
+		calloc(thread_count + 1, sizeof(*threads));
+	if (threads == NULL)
+		return -1;
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		free(threads);
+		return -1;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":"
+		"%llu},\n\"traceEvents\":[\n{\"name\":\"process_name\","
+		"\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"libcoro\"}}",
+		(unsigned long long)first);
+	for (unsigned i = 0; i < thread_count; ++i) {
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+			i, i == 0 ? "main" : "worker", i);
+	}
+	uint64_t last = origin;
+	for (uint64_t pos = first; pos < head; ++pos) {
+		/* Events, overwritten since the first pass, are lost. */
+		if (! coro_trace_read(pos, &e) || e.thread >= thread_count)
+			continue;
+		if (e.ticks > last)
+			last = e.ticks;
+		if (e.type == CORO_TRACE_SWITCH) {
+			struct coro_trace_thread *t = &threads[e.thread];
+			if (t->is_known && t->coro_id == e.coro_id) {
+				coro_trace_print_slice(f, t->coro_id, e.thread,
+						       t->since, e.ticks,
+						       origin);
+			}
+			t->is_known = true;
+			t->coro_id = e.arg;
+			t->since = e.ticks;
+			continue;
+		}
+		double ts = (e.ticks - origin) * trace.ns_per_tick / 1000;
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"coro\",\"ph\":\"i\","
+			"\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+			"\"args\":{\"coro\":%llu}}",
+			coro_trace_event_names[e.type], ts, e.thread,
+			(unsigned long long)e.coro_id);
+	}
+	/* Close the slices, running at the moment of the export. */
+	for (unsigned i = 0; i < thread_count; ++i) {
+		struct coro_trace_thread *t = &threads[i];
+		if (t->is_known && last > t->since) {
+			coro_trace_print_slice(f, t->coro_id, i, t->since, last,
+					       origin);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	free(threads);
+	if (ferror(f)) {
+		fclose(f);
+		errno = EIO;
+		return -1;
+	}
+	return fclose(f);
+}
+
+int
+coro_latency(const struct coro *c, struct coro_latency *latency)
+{
+	struct coro_trace_stats *stats = coro_trace_stats(c);
+	if (stats == NULL)
+		return -1;
+	*latency = stats->latency;
+	return 0;
+}
+
+/**
+ * Log-linear bucket of a duration: the power of 2 and the next
+ * CORO_HISTOGRAM_SUB_BITS bits after the highest one.
+ */
+static size_t
+coro_histogram_index(uint64_t ns)
+{
+	if (ns < CORO_HISTOGRAM_SUB_COUNT)
+		return ns;
+	size_t exp = 63 - __builtin_clzll(ns);
+	size_t sub = (ns >> (exp - CORO_HISTOGRAM_SUB_BITS)) &
+		     (CORO_HISTOGRAM_SUB_COUNT - 1);
+	size_t index = (exp - CORO_HISTOGRAM_SUB_BITS + 1) *
+		       CORO_HISTOGRAM_SUB_COUNT + sub;
+	if (index >= CORO_HISTOGRAM_BUCKETS)
+		index = CORO_HISTOGRAM_BUCKETS - 1;
+	return index;
+}
+
+/** The least duration, not fitting the bucket. */
+static uint64_t
+coro_histogram_bucket_end(size_t index)
+{
+	if (index < CORO_HISTOGRAM_SUB_COUNT)
+		return index + 1;
+	size_t exp = index / CORO_HISTOGRAM_SUB_COUNT +
+		     CORO_HISTOGRAM_SUB_BITS - 1;
+	size_t sub = index % CORO_HISTOGRAM_SUB_COUNT;
+	uint64_t step = (uint64_t)1 << (exp - CORO_HISTOGRAM_SUB_BITS);
+	return (CORO_HISTOGRAM_SUB_COUNT + sub + 1) * step;
+}
+
+void
+coro_histogram_add(struct coro_histogram *h, uint64_t ticks)
+{
+	uint64_t ns = ticks * trace.ns_per_tick;
+	++h->count;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	++h->buckets[coro_histogram_index(ns)];
+}
+
+uint64_t
+coro_histogram_percentile(const struct coro_histogram *h, double percent)
+{
+	if (h->count == 0)
+		return 0;
+	uint64_t rank = h->count * percent / 100;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < CORO_HISTOGRAM_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			uint64_t end = coro_histogram_bucket_end(i) - 1;
+			return end < h->max_ns ? end : h->max_ns;
+		}
+	}
+	return h->max_ns;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scheduler tracing. While it is on, the switches, creations,
+ * finishes, waits and wakeups of the coroutines are recorded into
+ * a ring buffer with their timestamps. The buffer is shared by all
+ * the threads and is written without locks. When it is full, the
+ * oldest events are overwritten. The events can be exported in the
+ * Chrome trace event format and viewed in chrome://tracing or
+ * Perfetto: a slice per run of a coroutine on a thread.
+ *
+ * Also each coroutine, created while tracing is on, keeps
+ * histograms of its time slices and scheduling delays. A slice is
+ * the time from a resume to the next switch away. A delay is the
+ * time from becoming ready to run to the resume.
+ */
+
+struct coro;
+
+enum {
+	/**
+	 * Histogram buckets. Each power of 2 nanoseconds is split
+	 * into 4 buckets, up to 2^40 ns (~18 minutes).
+	 */
+	CORO_HISTOGRAM_BUCKETS = 160,
+};
+
+/** Histogram of durations with ~25% precision. */
+struct coro_histogram {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[CORO_HISTOGRAM_BUCKETS];
+};
+
+struct coro_latency {
+	/** Time slices. */
+	struct coro_histogram slice;
+	/** Scheduling delays. */
+	struct coro_histogram delay;
+};
+
+/**
+ * Start recording. @a capacity is the number of events in the ring
+ * buffer, rounded up to a power of 2. 0 means the default of 64K.
+ * Coroutines, created before the start, are not traced.
+ * @retval -1 No memory.
+ */
+int
+coro_trace_start(size_t capacity);
+
+/**
+ * Stop recording and free the buffer. Should not be called while
+ * other threads run coroutines.
+ */
+void
+coro_trace_stop(void);
+
+/**
+ * Write the recorded events into the file @a path in the Chrome
+ * trace event JSON format.
+ * @retval -1 Error. Check errno.
+ */
+int
+coro_trace_export(const char *path);
+
+/** Number of events overwritten because the buffer was full. */
+uint64_t
+coro_trace_dropped(void);
+
+/**
+ * Get the latency histograms of a coroutine.
+ * @retval -1 The coroutine is not traced.
+ */
+int
+coro_latency(const struct coro *c, struct coro_latency *latency);
+
+/**
+ * Duration in nanoseconds, not exceeded by @a percent % of the
+ * histogram values. Precise up to the bucket size.
+ */
+uint64_t
+coro_histogram_percentile(const struct coro_histogram *h, double percent);
@@ -1,5 +1,6 @@
 import random
 import argparse
+import struct
 
 maxint = 1 << 31
 
@@ -7,10 +8,22 @@ parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('-b', action='store_true', help='binary format: "SI32", LE u32 '\
+		    'version 1, LE u64 count, LE int32 numbers')
 args = parser.parse_args()
 random.seed()
 
 
+if args.b:
+	f = open(args.f, 'wb')
+	f.write(b'SI32' + struct.pack('<IQ', 1, args.c))
+	# int32 holds at most maxint - 1
+	top = min(args.m, maxint - 1)
+	numbers = [random.randint(0, top) for i in range(0, args.c)]
+	f.write(struct.pack('<{}i'.format(args.c), *numbers))
+	f.close()
+	exit(0)
+
 f = open(args.f, 'w')
 
 for i in range(0, args.c):
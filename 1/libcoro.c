@@ -1,12 +1,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "libcoro.h"
+#include "coro_stack.h"
+#include "libcoro_impl.h"
 
+/*
+ * Context switch backend. By default a hand-written assembly
+ * switch is used where it is available: it only saves callee-saved
+ * registers and the stack pointer. The original sigaltstack-based
+ * trampoline with sigsetjmp()/siglongjmp() is kept as a portable
+ * fallback and can be forced with -DCORO_SWITCH_SIGNAL.
+ */
+#if !defined(CORO_SWITCH_SIGNAL) && defined(__ELF__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_SWITCH_ASM 1
+#else
+#undef CORO_SWITCH_SIGNAL
+#define CORO_SWITCH_SIGNAL 1
+#endif
+
+#define lengthof(array) (sizeof(array) / sizeof((array)[0]))
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
 /** Main coroutine structure, its context. */
@@ -14,142 +42,1748 @@ struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
-	void *stack;
+	struct coro_stack *stack;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#if CORO_SWITCH_ASM
+	/**
+	 * Saved stack pointer. Callee-saved registers and the
+	 * resume address are stored on the stack itself.
+	 */
+	void *sp;
+#else
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#endif
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * True for a generator. It is not scheduled, but runs only
+	 * when resumed, and is not returned by coro_sched_wait().
+	 */
+	bool is_generator;
+	/** Who waits in coro_resume() for this generator. */
+	struct coro *resumer;
+	/**
+	 * A value, passed to the coroutine on a switch into it by
+	 * coro_resume() or coro_yield_value().
+	 */
+	void *value;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Ticks spent running, see coro_ticks(). */
+	uint64_t run_ticks;
+	/** Ticks spent suspended. */
+	uint64_t wait_ticks;
+	/**
+	 * When the coroutine was resumed, if it is running now.
+	 * Otherwise when it was suspended.
+	 */
+	uint64_t switched_at;
+	/** Time slice in ticks for coro_yield_if_expired(). */
+	uint64_t quantum;
+	/** Scheduling parameters, see struct coro_attr. */
+	int priority;
+	unsigned weight;
+	/** Relative deadline in ticks. 0 - none. */
+	uint64_t deadline;
+	/**
+	 * Order in a heap run queue: the virtual run time for the
+	 * fair policy, the absolute deadline for EDF.
+	 */
+	uint64_t sched_key;
+	/** Breaks the ties of sched_key in the FIFO order. */
+	uint64_t sched_seq;
+	/**
+	 * Fair policy: is added to run_ticks / weight, so as the
+	 * coroutine, which has waited for long, does not take the
+	 * CPU until it catches up with the others.
+	 */
+	uint64_t vruntime_offset;
+	/** Arena and key values. */
+	struct coro_local local;
+	/** Tracing state, if the coroutine is traced. */
+	struct coro_trace_stats *trace;
+	/** Cancellation is requested, see coro_cancel(). */
+	atomic_bool is_cancelled;
+	/** False while the cancellation is deferred. */
+	bool is_cancellable;
+	/** True while waiting in coro_wait_children(). */
+	bool is_waiting_children;
+	/**
+	 * How coro_cancel() interrupts the current wait, see
+	 * coro_wait_begin(). NULL, if the coroutine is not in a
+	 * cancellable wait. Protected by wait_lock.
+	 */
+	coro_wait_cancel_f wait_cancel;
+	void *wait_cancel_arg;
+	pthread_mutex_t wait_lock;
+	/**
+	 * True while coro_cancel() interrupts the wait out of the
+	 * family lock. Then coro_delete() waits for it.
+	 */
+	atomic_bool is_interrupting;
+	/** Next coroutine to interrupt by the same coro_cancel(). */
+	struct coro *next_interrupting;
+	/**
+	 * Nursery: the coroutine, which has created this one as its
+	 * child, and the not finished children. Protected by
+	 * family_lock.
+	 */
+	struct coro *parent;
+	struct coro *first_child;
+	struct coro *next_sibling, *prev_sibling;
+	/**
+	 * Links in a scheduler queue: either a run queue, or the
+	 * finished queue.
+	 */
 	struct coro *next, *prev;
 };
 
+/** FIFO of coroutines, linked through their next/prev. */
+struct coro_queue {
+	struct coro *first, *last;
+	size_t count;
+};
+
+/**
+ * Ready coroutines of a thread in the order of the scheduling
+ * policy. The FIFO and priority policies use the lists, the fair
+ * and EDF ones use the heap.
+ */
+struct coro_run_queue {
+	const struct coro_policy *policy;
+	/** A FIFO per priority. The FIFO policy uses only the 0th. */
+	struct coro_queue levels[CORO_PRIORITY_MAX + 1];
+	/** Bit per non-empty level. */
+	unsigned level_mask;
+	/** Binary min-heap by sched_key and sched_seq. */
+	struct coro **heap;
+	size_t heap_capacity;
+	/** Source of sched_seq. */
+	uint64_t seq;
+	/** Fair policy: the virtual time, the last popped key. */
+	uint64_t min_key;
+	/** Number of coroutines in the queue. */
+	size_t count;
+};
+
+/** Scheduling policy, the run queue operations. */
+struct coro_policy {
+	/**
+	 * Add a ready coroutine. @a is_woken means it has just
+	 * become ready, not yielded or moved from another queue.
+	 */
+	void
+	(*push)(struct coro_run_queue *q, struct coro *c, bool is_woken);
+	/** Take the coroutine to run next. NULL, if empty. */
+	struct coro *
+	(*pop)(struct coro_run_queue *q);
+	/** Take a coroutine, which would run last, to steal it. */
+	struct coro *
+	(*pop_last)(struct coro_run_queue *q);
+	/**
+	 * True, if a queued coroutine should run before the
+	 * running @a c, if @a c yields now.
+	 */
+	bool
+	(*is_preempted)(struct coro_run_queue *q, struct coro *c);
+};
+
+/**
+ * Scheduling state of one thread. In the single-thread mode there
+ * is only the main thread's worker. In the multi-thread mode each
+ * worker thread has its own run queue, and idle workers steal
+ * coroutines from the busy ones.
+ */
+struct coro_worker {
+	/**
+	 * Context of the thread itself. For the main thread it is
+	 * the scheduler, for a worker thread - its dispatch loop.
+	 */
+	struct coro base;
+	/** Which coroutine works at this moment on the thread. */
+	struct coro *current;
+	/** Coroutines ready to run here, except the current one. */
+	struct coro_run_queue run_queue;
+	/** Protects the run queue in the multi-thread mode. */
+	pthread_mutex_t lock;
+	/** Yields done since the last non-blocking I/O poll. */
+	size_t yields_since_poll;
+	/**
+	 * A coroutine, which has just finished on this thread. It
+	 * is handed to the scheduler only after the switch away
+	 * from its stack, because the scheduler can delete it
+	 * right away.
+	 */
+	struct coro *finished;
+	/**
+	 * A coroutine, which has just yielded on this thread. It
+	 * is made runnable only after its context is saved.
+	 * Otherwise another thread could steal and resume it
+	 * while it is still running here.
+	 */
+	struct coro *yielded;
+	/**
+	 * A lock, held by a coroutine, which has just parked on
+	 * this thread. It is released only after the switch, so as
+	 * a waker, taking the same lock, can't resume the coroutine
+	 * before its context is saved.
+	 */
+	pthread_mutex_t *park_lock;
+	/** Eventfd to wake the thread up from an idle sleep. */
+	int wakeup_fd;
+	/** True while the thread sleeps having nothing to do. */
+	atomic_bool is_idle;
+	pthread_t thread;
+};
+
 /**
  * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * ones to a user. It is the base context of the main thread.
+ */
+static struct coro_worker main_worker;
+/** Worker threads. None in the single-thread mode. */
+static struct coro_worker *workers = NULL;
+static int worker_count = 0;
+/** True, if coroutines are run by the worker threads. */
+static bool is_mt = false;
+/** Worker threads should exit. */
+static atomic_bool is_stopping = false;
+/** Number of workers sleeping in coro_worker_idle(). */
+static atomic_int idle_count = 0;
+/** Round-robin cursor to place new coroutines from main. */
+static atomic_uint next_worker = 0;
+/** Worker of the current thread. */
+static __thread struct coro_worker *worker_this_ptr = NULL;
+/**
+ * True, if in that moment the scheduler is waiting for a
+ * coroutine finish. Only for the single-thread mode.
+ */
+static bool is_sched_waiting = false;
+/**
+ * When coro_wait_timeout() gives up, in ticks. 0 - no timeout.
+ * Only for the single-thread mode.
+ */
+static uint64_t sched_wait_deadline = 0;
+/** Finished coroutines, not yet returned by coro_sched_wait(). */
+static struct coro_queue finished_queue;
+/** Coroutines not yet returned by coro_sched_wait(). */
+static size_t coro_count = 0;
+/** Protect the finished queue in the multi-thread mode. */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+/**
+ * Serializes the generator switches with the main thread in the
+ * multi-thread mode, see coro_resume().
+ */
+static pthread_mutex_t generator_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Protects the parent and child links of all the coroutines. */
+static pthread_mutex_t family_lock = PTHREAD_MUTEX_INITIALIZER;
+#if CORO_SWITCH_SIGNAL
+/**
+ * Buffer, used by the coroutine constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static __thread sigjmp_buf start_point;
+/** Coroutine being created, for the signal handler. */
+static __thread struct coro *coro_creating = NULL;
+/** Signal handlers are global - serialize the creation. */
+static pthread_mutex_t creation_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * CPU cycle counter. It is much cheaper than clock_gettime(),
+ * which matters because it is read on every switch.
  */
-static struct coro coro_sched;
+static inline uint64_t
+coro_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+#endif
+}
+
+/** Ticks per second, see coro_ticks_calibrate(). */
+static double ticks_per_sec = 0;
+
+static double
+coro_clock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Find the tick frequency, once per process. */
+static void
+coro_ticks_calibrate(void)
+{
+	if (ticks_per_sec != 0)
+		return;
+#if defined(__x86_64__) || defined(__i386__)
+	/*
+	 * TSC frequency is not exposed to the user space. Measure
+	 * it against the monotonic clock. A millisecond gives
+	 * enough precision for time slices.
+	 */
+	double start = coro_clock_now();
+	uint64_t start_ticks = coro_ticks();
+	double now;
+	while ((now = coro_clock_now()) - start < 0.001)
+		;
+	ticks_per_sec = (coro_ticks() - start_ticks) / (now - start);
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	ticks_per_sec = freq;
+#else
+	ticks_per_sec = 1e9;
+#endif
+}
+
+/** The main thread's context, which can't run coroutines. */
+static inline bool
+coro_is_mt_main(const struct coro *c)
+{
+	return is_mt && c == &main_worker.base;
+}
+
+/** Add a coroutine to the end of the queue. */
+static void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+	++q->count;
+}
+
+/** Remove a coroutine from any place in the queue. */
+static void
+coro_queue_delete(struct coro_queue *q, struct coro *c)
+{
+	struct coro *prev = c->prev, *next = c->next;
+	if (prev != NULL)
+		prev->next = next;
+	else
+		q->first = next;
+	if (next != NULL)
+		next->prev = prev;
+	else
+		q->last = prev;
+	c->next = c->prev = NULL;
+	--q->count;
+}
+
+/** Take the first coroutine of the queue. NULL, if empty. */
+static struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_delete(q, c);
+	return c;
+}
+
+/* FIFO and priority policies. */
+
+static void
+coro_levels_push(struct coro_run_queue *q, struct coro *c, int level)
+{
+	coro_queue_push(&q->levels[level], c);
+	q->level_mask |= 1u << level;
+	++q->count;
+}
+
+static struct coro *
+coro_levels_take(struct coro_run_queue *q, int level, bool is_last)
+{
+	struct coro_queue *l = &q->levels[level];
+	struct coro *c = is_last ? l->last : l->first;
+	coro_queue_delete(l, c);
+	if (l->count == 0)
+		q->level_mask &= ~(1u << level);
+	--q->count;
+	return c;
+}
+
+static void
+coro_fifo_push(struct coro_run_queue *q, struct coro *c, bool is_woken)
+{
+	(void)is_woken;
+	coro_levels_push(q, c, 0);
+}
+
+static struct coro *
+coro_fifo_pop(struct coro_run_queue *q)
+{
+	if (q->count == 0)
+		return NULL;
+	return coro_levels_take(q, 0, false);
+}
+
+static struct coro *
+coro_fifo_pop_last(struct coro_run_queue *q)
+{
+	if (q->count == 0)
+		return NULL;
+	return coro_levels_take(q, 0, true);
+}
+
+static bool
+coro_fifo_is_preempted(struct coro_run_queue *q, struct coro *c)
+{
+	(void)c;
+	return q->count > 0;
+}
+
+static void
+coro_priority_push(struct coro_run_queue *q, struct coro *c, bool is_woken)
+{
+	(void)is_woken;
+	coro_levels_push(q, c, c->priority);
+}
+
+static struct coro *
+coro_priority_pop(struct coro_run_queue *q)
+{
+	if (q->level_mask == 0)
+		return NULL;
+	int level = 31 - __builtin_clz(q->level_mask);
+	return coro_levels_take(q, level, false);
+}
+
+static struct coro *
+coro_priority_pop_last(struct coro_run_queue *q)
+{
+	if (q->level_mask == 0)
+		return NULL;
+	return coro_levels_take(q, __builtin_ctz(q->level_mask), true);
+}
+
+static bool
+coro_priority_is_preempted(struct coro_run_queue *q, struct coro *c)
+{
+	return (q->level_mask >> c->priority) != 0;
+}
+
+/* Heap-based policies: fair and EDF. */
+
+static inline bool
+coro_heap_less(const struct coro *a, const struct coro *b)
+{
+	if (a->sched_key != b->sched_key)
+		return a->sched_key < b->sched_key;
+	return a->sched_seq < b->sched_seq;
+}
+
+static void
+coro_heap_sift_up(struct coro_run_queue *q, size_t index)
+{
+	struct coro *c = q->heap[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (! coro_heap_less(c, q->heap[parent]))
+			break;
+		q->heap[index] = q->heap[parent];
+		index = parent;
+	}
+	q->heap[index] = c;
+}
+
+static void
+coro_heap_sift_down(struct coro_run_queue *q, size_t index)
+{
+	struct coro *c = q->heap[index];
+	while (true) {
+		size_t child = index * 2 + 1;
+		if (child >= q->count)
+			break;
+		if (child + 1 < q->count &&
+		    coro_heap_less(q->heap[child + 1], q->heap[child]))
+			++child;
+		if (! coro_heap_less(q->heap[child], c))
+			break;
+		q->heap[index] = q->heap[child];
+		index = child;
+	}
+	q->heap[index] = c;
+}
+
+static void
+coro_heap_push(struct coro_run_queue *q, struct coro *c)
+{
+	if (q->count == q->heap_capacity) {
+		size_t capacity =
+			q->heap_capacity == 0 ? 16 : q->heap_capacity * 2;
+		struct coro **heap =
+			realloc(q->heap, capacity * sizeof(*heap));
+		if (heap == NULL)
+			handle_error();
+		q->heap = heap;
+		q->heap_capacity = capacity;
+	}
+	c->sched_seq = q->seq++;
+	q->heap[q->count++] = c;
+	coro_heap_sift_up(q, q->count - 1);
+}
+
+static struct coro *
+coro_heap_pop(struct coro_run_queue *q)
+{
+	if (q->count == 0)
+		return NULL;
+	struct coro *c = q->heap[0];
+	if (--q->count > 0) {
+		q->heap[0] = q->heap[q->count];
+		coro_heap_sift_down(q, 0);
+	}
+	return c;
+}
+
+/** A leaf is removed without sifting. It is one of the last. */
+static struct coro *
+coro_heap_pop_last(struct coro_run_queue *q)
+{
+	if (q->count == 0)
+		return NULL;
+	return q->heap[--q->count];
+}
+
+static void
+coro_fair_push(struct coro_run_queue *q, struct coro *c, bool is_woken)
+{
+	(void)is_woken;
+	uint64_t key = c->run_ticks / c->weight + c->vruntime_offset;
+	if (key < q->min_key) {
+		c->vruntime_offset += q->min_key - key;
+		key = q->min_key;
+	}
+	c->sched_key = key;
+	coro_heap_push(q, c);
+}
+
+static struct coro *
+coro_fair_pop(struct coro_run_queue *q)
+{
+	struct coro *c = coro_heap_pop(q);
+	if (c != NULL && c->sched_key > q->min_key)
+		q->min_key = c->sched_key;
+	return c;
+}
+
+static bool
+coro_fair_is_preempted(struct coro_run_queue *q, struct coro *c)
+{
+	if (q->count == 0)
+		return false;
+	/* The current slice is not accounted yet. */
+	uint64_t run_ticks = c->run_ticks + coro_ticks() - c->switched_at;
+	return q->heap[0]->sched_key <= run_ticks / c->weight +
+					c->vruntime_offset;
+}
+
+static void
+coro_edf_push(struct coro_run_queue *q, struct coro *c, bool is_woken)
+{
+	if (is_woken) {
+		c->sched_key = UINT64_MAX;
+		if (c->deadline != 0)
+			c->sched_key = coro_ticks() + c->deadline;
+	}
+	coro_heap_push(q, c);
+}
+
+static bool
+coro_edf_is_preempted(struct coro_run_queue *q, struct coro *c)
+{
+	return q->count > 0 && q->heap[0]->sched_key <= c->sched_key;
+}
+
+static const struct coro_policy coro_policies[] = {
+	[CORO_SCHED_FIFO] = {
+		coro_fifo_push, coro_fifo_pop, coro_fifo_pop_last,
+		coro_fifo_is_preempted,
+	},
+	[CORO_SCHED_PRIORITY] = {
+		coro_priority_push, coro_priority_pop, coro_priority_pop_last,
+		coro_priority_is_preempted,
+	},
+	[CORO_SCHED_FAIR] = {
+		coro_fair_push, coro_fair_pop, coro_heap_pop_last,
+		coro_fair_is_preempted,
+	},
+	[CORO_SCHED_EDF] = {
+		coro_edf_push, coro_heap_pop, coro_heap_pop_last,
+		coro_edf_is_preempted,
+	},
+};
+
+static void
+coro_run_queue_create(struct coro_run_queue *q)
+{
+	memset(q, 0, sizeof(*q));
+	q->policy = &coro_policies[CORO_SCHED_FIFO];
+}
+
+static void
+coro_run_queue_destroy(struct coro_run_queue *q)
+{
+	free(q->heap);
+	q->heap = NULL;
+	q->heap_capacity = 0;
+}
+
+static inline void
+coro_run_queue_push(struct coro_run_queue *q, struct coro *c, bool is_woken)
+{
+	q->policy->push(q, c, is_woken);
+}
+
+static inline struct coro *
+coro_run_queue_pop(struct coro_run_queue *q)
+{
+	return q->policy->pop(q);
+}
+
+/**
+ * Worker of the current thread. A coroutine can move to another
+ * thread at any switch, so the thread-local variable is always
+ * read via a call, which the compiler can not cache.
+ */
+static __attribute__((noinline)) struct coro_worker *
+coro_worker_this(void)
+{
+	__asm__ volatile("");
+	return worker_this_ptr;
+}
+
+static inline void
+coro_worker_lock(struct coro_worker *w)
+{
+	if (is_mt)
+		pthread_mutex_lock(&w->lock);
+}
+
+static inline void
+coro_worker_unlock(struct coro_worker *w)
+{
+	if (is_mt)
+		pthread_mutex_unlock(&w->lock);
+}
+
+/** Wake the thread up, if it sleeps having nothing to do. */
+static void
+coro_worker_notify(struct coro_worker *w)
+{
+	bool is_idle = true;
+	if (! atomic_compare_exchange_strong(&w->is_idle, &is_idle, false))
+		return;
+	uint64_t one = 1;
+	if (write(w->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+/** Make a coroutine runnable on the given thread. */
+static void
+coro_worker_push(struct coro_worker *w, struct coro *c)
+{
+	coro_worker_lock(w);
+	coro_run_queue_push(&w->run_queue, c, true);
+	coro_worker_unlock(w);
+	if (is_mt)
+		coro_worker_notify(w);
+}
+
+/** Take the next runnable coroutine of the thread. */
+static struct coro *
+coro_worker_pop(struct coro_worker *w)
+{
+	coro_worker_lock(w);
+	struct coro *c = coro_run_queue_pop(&w->run_queue);
+	coro_worker_unlock(w);
+	return c;
+}
+
+/** Wake up one idle worker to steal some work. */
+static void
+coro_worker_notify_idle(void)
+{
+	if (atomic_load(&idle_count) == 0)
+		return;
+	for (int i = 0; i < worker_count; ++i) {
+		if (atomic_load(&workers[i].is_idle)) {
+			coro_worker_notify(&workers[i]);
+			return;
+		}
+	}
+}
+
+double
+coro_ticks_per_sec(void)
+{
+	coro_ticks_calibrate();
+	return ticks_per_sec;
+}
+
+/** Thread number in the trace events. The main thread is 0. */
+static unsigned
+coro_worker_index(const struct coro_worker *w)
+{
+	if (w == &main_worker)
+		return 0;
+	return (unsigned)(w - workers) + 1;
+}
+
+static inline uint64_t
+coro_trace_id(const struct coro *c)
+{
+	return c->trace != NULL ? c->trace->id : 0;
+}
+
+/** Record an event about the coroutine, if it is traced. */
+static inline void
+coro_trace_event(enum coro_trace_event_type type, struct coro *c)
+{
+	if (! coro_trace_is_enabled())
+		return;
+	coro_trace_record(type, coro_ticks(),
+			  coro_worker_index(coro_worker_this()),
+			  coro_trace_id(c), 0);
+}
+
+/** Remember when the coroutine became ready to run. */
+static inline void
+coro_trace_ready(struct coro *c)
+{
+	if (coro_trace_is_enabled() && c->trace != NULL)
+		c->trace->ready_at = coro_ticks();
+}
+
+static void
+coro_trace_switch(struct coro *from, struct coro *to, uint64_t now)
+{
+	if (from->trace != NULL) {
+		coro_histogram_add(&from->trace->latency.slice,
+				   now - from->switched_at);
+	}
+	struct coro_trace_stats *trace = to->trace;
+	if (trace != NULL && trace->ready_at != 0) {
+		coro_histogram_add(&trace->latency.delay,
+				   now - trace->ready_at);
+		trace->ready_at = 0;
+	}
+	coro_trace_record(CORO_TRACE_SWITCH, now,
+			  coro_worker_index(coro_worker_this()),
+			  coro_trace_id(from), coro_trace_id(to));
+}
+
+/**
+ * Account the switch from one coroutine to another at the same
+ * moment. @a from == @a to is a yield, which continues the same
+ * coroutine. It ends a slice too.
+ */
+static inline void
+coro_account_switch(struct coro *from, struct coro *to)
+{
+	uint64_t now = coro_ticks();
+	if (coro_trace_is_enabled())
+		coro_trace_switch(from, to, now);
+	from->run_ticks += now - from->switched_at;
+	from->switched_at = now;
+	to->wait_ticks += now - to->switched_at;
+	to->switched_at = now;
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+double
+coro_run_time(const struct coro *c)
+{
+	uint64_t ticks = c->run_ticks;
+	if (c == coro_this())
+		ticks += coro_ticks() - c->switched_at;
+	return ticks / ticks_per_sec;
+}
+
+double
+coro_wait_time(const struct coro *c)
+{
+	uint64_t ticks = c->wait_ticks;
+	if (c != coro_this() && ! c->is_finished)
+		ticks += coro_ticks() - c->switched_at;
+	return ticks / ticks_per_sec;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+/** Make @a c a child of @a parent. */
+static void
+coro_family_join(struct coro *c, struct coro *parent)
+{
+	pthread_mutex_lock(&family_lock);
+	c->parent = parent;
+	c->next_sibling = parent->first_child;
+	if (parent->first_child != NULL)
+		parent->first_child->prev_sibling = c;
+	parent->first_child = c;
+	/* Children of a cancelled parent are cancelled right away. */
+	if (atomic_load(&parent->is_cancelled))
+		atomic_store(&c->is_cancelled, true);
+	pthread_mutex_unlock(&family_lock);
+}
+
+/**
+ * Unlink @a c from its parent and its children. The parent is
+ * woken up, if it waits for the last child.
+ */
+static void
+coro_family_leave(struct coro *c)
+{
+	pthread_mutex_lock(&family_lock);
+	struct coro *parent = c->parent;
+	if (parent != NULL) {
+		if (c->prev_sibling != NULL)
+			c->prev_sibling->next_sibling = c->next_sibling;
+		else
+			parent->first_child = c->next_sibling;
+		if (c->next_sibling != NULL)
+			c->next_sibling->prev_sibling = c->prev_sibling;
+		c->parent = c->next_sibling = c->prev_sibling = NULL;
+		if (parent->first_child == NULL &&
+		    parent->is_waiting_children) {
+			parent->is_waiting_children = false;
+			coro_wakeup(parent);
+		}
+	}
+	struct coro *child = c->first_child;
+	while (child != NULL) {
+		struct coro *next = child->next_sibling;
+		child->parent = child->next_sibling = child->prev_sibling = NULL;
+		child = next;
+	}
+	c->first_child = NULL;
+	pthread_mutex_unlock(&family_lock);
+}
+
+void
+coro_delete(struct coro *c)
+{
+	if (c->stack->is_painted)
+		coro_stack_usage_add(c->func, coro_stack_measure(c->stack));
+	/* A generator can be deleted before the finish. */
+	if (! c->is_finished)
+		coro_family_leave(c);
+	/* A child can be just interrupted by its parent's cancel. */
+	while (atomic_load(&c->is_interrupting))
+		sched_yield();
+	coro_local_destroy(&c->local);
+	pthread_mutex_destroy(&c->wait_lock);
+	free(c->trace);
+	coro_stack_delete(c->stack);
+	free(c);
+}
+
+#if CORO_SWITCH_ASM
+
+/**
+ * Save callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, load @a to_sp and restore the
+ * registers saved there. Returns into the context, which was
+ * active when @a to_sp was saved.
+ */
+void
+coro_ctx_switch(void **from_sp, void *to_sp);
+
+/**
+ * The first code executed on a new coroutine stack. It takes the
+ * coroutine and the entry function from the callee-saved
+ * registers, prepared by coro_ctx_prepare().
+ */
+void
+coro_ctx_start(void);
+
+#if defined(__x86_64__)
+
+__asm__(
+"	.text\n"
+"	.globl coro_ctx_switch\n"
+"	.hidden coro_ctx_switch\n"
+"	.type coro_ctx_switch, @function\n"
+"	.p2align 4\n"
+"coro_ctx_switch:\n"
+"	pushq %rbp\n"
+"	pushq %rbx\n"
+"	pushq %r12\n"
+"	pushq %r13\n"
+"	pushq %r14\n"
+"	pushq %r15\n"
+"	movq %rsp, (%rdi)\n"
+"	movq %rsi, %rsp\n"
+"	popq %r15\n"
+"	popq %r14\n"
+"	popq %r13\n"
+"	popq %r12\n"
+"	popq %rbx\n"
+"	popq %rbp\n"
+"	ret\n"
+"	.size coro_ctx_switch, .-coro_ctx_switch\n"
+"\n"
+"	.globl coro_ctx_start\n"
+"	.hidden coro_ctx_start\n"
+"	.type coro_ctx_start, @function\n"
+"	.p2align 4\n"
+"coro_ctx_start:\n"
+"	movq %r12, %rdi\n"
+"	callq *%r13\n"
+"	ud2\n"
+"	.size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+/** Number of words in the initial frame: 6 registers + return. */
+enum { CORO_CTX_FRAME_WORDS = 7 };
+
+static void
+coro_ctx_prepare(struct coro *c, void *stack_top, void (*entry)(struct coro *))
+{
+	/*
+	 * After the registers are popped and 'ret' jumps into
+	 * coro_ctx_start() the stack pointer is equal to the
+	 * aligned top, so the 'call' there produces a frame
+	 * aligned as the ABI requires.
+	 */
+	void **sp = (void **)stack_top - CORO_CTX_FRAME_WORDS;
+	memset(sp, 0, CORO_CTX_FRAME_WORDS * sizeof(*sp));
+	sp[2] = (void *)entry;		/* r13 */
+	sp[3] = c;			/* r12 */
+	sp[6] = (void *)coro_ctx_start;	/* Return address. */
+	c->sp = sp;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+"	.text\n"
+"	.globl coro_ctx_switch\n"
+"	.hidden coro_ctx_switch\n"
+"	.type coro_ctx_switch, %function\n"
+"	.p2align 4\n"
+"coro_ctx_switch:\n"
+"	sub sp, sp, #160\n"
+"	stp x19, x20, [sp, #0]\n"
+"	stp x21, x22, [sp, #16]\n"
+"	stp x23, x24, [sp, #32]\n"
+"	stp x25, x26, [sp, #48]\n"
+"	stp x27, x28, [sp, #64]\n"
+"	stp x29, x30, [sp, #80]\n"
+"	stp d8, d9, [sp, #96]\n"
+"	stp d10, d11, [sp, #112]\n"
+"	stp d12, d13, [sp, #128]\n"
+"	stp d14, d15, [sp, #144]\n"
+"	mov x2, sp\n"
+"	str x2, [x0]\n"
+"	mov sp, x1\n"
+"	ldp x19, x20, [sp, #0]\n"
+"	ldp x21, x22, [sp, #16]\n"
+"	ldp x23, x24, [sp, #32]\n"
+"	ldp x25, x26, [sp, #48]\n"
+"	ldp x27, x28, [sp, #64]\n"
+"	ldp x29, x30, [sp, #80]\n"
+"	ldp d8, d9, [sp, #96]\n"
+"	ldp d10, d11, [sp, #112]\n"
+"	ldp d12, d13, [sp, #128]\n"
+"	ldp d14, d15, [sp, #144]\n"
+"	add sp, sp, #160\n"
+"	ret\n"
+"	.size coro_ctx_switch, .-coro_ctx_switch\n"
+"\n"
+"	.globl coro_ctx_start\n"
+"	.hidden coro_ctx_start\n"
+"	.type coro_ctx_start, %function\n"
+"	.p2align 4\n"
+"coro_ctx_start:\n"
+"	mov x0, x19\n"
+"	blr x20\n"
+"	brk #0\n"
+"	.size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+/** x19-x30 and d8-d15, 16-byte aligned. */
+enum { CORO_CTX_FRAME_WORDS = 20 };
+
+static void
+coro_ctx_prepare(struct coro *c, void *stack_top, void (*entry)(struct coro *))
+{
+	void **sp = (void **)stack_top - CORO_CTX_FRAME_WORDS;
+	memset(sp, 0, CORO_CTX_FRAME_WORDS * sizeof(*sp));
+	sp[0] = c;			/* x19 */
+	sp[1] = (void *)entry;		/* x20 */
+	sp[11] = (void *)coro_ctx_start;	/* x30, return address. */
+	c->sp = sp;
+}
+
+#endif /* __aarch64__ */
+
+/** Save the current context into @a from and resume @a to. */
+static inline void
+coro_transfer(struct coro *from, struct coro *to)
+{
+	coro_ctx_switch(&from->sp, to->sp);
+}
+
+#else /* CORO_SWITCH_SIGNAL */
+
+/** Save the current context into @a from and resume @a to. */
+static inline void
+coro_transfer(struct coro *from, struct coro *to)
+{
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+}
+
+#endif /* CORO_SWITCH_SIGNAL */
+
+/**
+ * Finish the work, which can be done only after a switch away
+ * from the previous coroutine stack.
+ */
+static void
+coro_after_switch(struct coro_worker *w)
+{
+	if (w->park_lock != NULL) {
+		pthread_mutex_unlock(w->park_lock);
+		w->park_lock = NULL;
+	}
+	struct coro *yielded = w->yielded;
+	if (yielded != NULL) {
+		w->yielded = NULL;
+		coro_worker_lock(w);
+		coro_run_queue_push(&w->run_queue, yielded, false);
+		size_t count = w->run_queue.count;
+		coro_worker_unlock(w);
+		if (count > 1)
+			coro_worker_notify_idle();
+	}
+	struct coro *finished = w->finished;
+	if (finished == NULL)
+		return;
+	w->finished = NULL;
+	pthread_mutex_lock(&sched_lock);
+	coro_queue_push(&finished_queue, finished);
+	pthread_cond_signal(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/** Switch the current coroutine to an arbitrary one. */
+static void
+coro_yield_to(struct coro *to)
+{
+	struct coro_worker *w = coro_worker_this();
+	struct coro *from = w->current;
+	++from->switch_count;
+	coro_account_switch(from, to);
+	w->current = to;
+	coro_transfer(from, to);
+	/* Can be another thread now. */
+	coro_after_switch(coro_worker_this());
+}
+
+/**
+ * Pick the next coroutine to run. If none is ready, but some wait
+ * for I/O, sleep until one of them is woken up. In the
+ * multi-thread mode the thread's dispatch loop is the fallback,
+ * it steals work or sleeps. In the single-thread mode the
+ * scheduler is, when coro_wait_timeout() has timed out.
+ * @retval NULL Nothing can ever run.
+ */
+static struct coro *
+coro_sched_next(struct coro_worker *w)
+{
+	while (true) {
+		struct coro *c = coro_worker_pop(w);
+		if (c != NULL)
+			return c;
+		if (is_mt)
+			return &w->base;
+		double timeout = -1;
+		if (sched_wait_deadline != 0) {
+			/* The scheduler waits with a timeout - go back to it. */
+			uint64_t now = coro_ticks();
+			if (now >= sched_wait_deadline)
+				return &main_worker.base;
+			timeout = (sched_wait_deadline - now) / ticks_per_sec;
+		} else if (! coro_io_has_waiters()) {
+			return NULL;
+		}
+		coro_io_poll(timeout);
+	}
+}
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Sleep until the thread gets some work, an fd becomes ready or
+ * a timer expires. Multi-thread mode only.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static void
+coro_worker_idle(struct coro_worker *w)
+{
+	atomic_store(&w->is_idle, true);
+	atomic_fetch_add(&idle_count, 1);
+	/*
+	 * Check the queue again after the flag is set. Otherwise a
+	 * coroutine pushed right before could be not noticed.
+	 */
+	coro_worker_lock(w);
+	bool has_work = w->run_queue.count > 0;
+	coro_worker_unlock(w);
+	if (! has_work && ! atomic_load(&is_stopping))
+		coro_io_poll(-1);
+	atomic_store(&w->is_idle, false);
+	atomic_fetch_sub(&idle_count, 1);
+}
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Take a half of the run queue of some other worker.
+ * @retval NULL Nothing to steal.
  */
-static sigjmp_buf start_point;
+static struct coro *
+coro_worker_steal(struct coro_worker *thief)
+{
+	int self = thief - workers;
+	for (int i = 1; i < worker_count; ++i) {
+		struct coro_worker *victim = &workers[(self + i) % worker_count];
+		struct coro_queue stolen = {NULL, NULL, 0};
+		coro_worker_lock(victim);
+		struct coro_run_queue *q = &victim->run_queue;
+		size_t count = (q->count + 1) / 2;
+		/*
+		 * Take the ones, which would run last. The owner
+		 * takes the first ones.
+		 */
+		for (size_t j = 0; j < count; ++j)
+			coro_queue_push(&stolen, q->policy->pop_last(q));
+		coro_worker_unlock(victim);
+		if (stolen.count == 0)
+			continue;
+		coro_worker_lock(thief);
+		while (stolen.count > 0) {
+			coro_run_queue_push(&thief->run_queue,
+					    coro_queue_pop(&stolen), false);
+		}
+		struct coro *c = coro_run_queue_pop(&thief->run_queue);
+		coro_worker_unlock(thief);
+		return c;
+	}
+	return NULL;
+}
 
-/** Add a new coroutine to the beginning of the list. */
-static void
-coro_list_add(struct coro *c)
+/** Dispatch loop of a worker thread. */
+static void *
+coro_worker_f(void *arg)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	struct coro_worker *w = arg;
+	worker_this_ptr = w;
+	w->current = &w->base;
+	if (coro_io_thread_init(w->wakeup_fd) != 0)
+		handle_error();
+	while (! atomic_load(&is_stopping)) {
+		struct coro *c = coro_worker_pop(w);
+		if (c == NULL)
+			c = coro_worker_steal(w);
+		if (c != NULL)
+			coro_yield_to(c);
+		else
+			coro_worker_idle(w);
+	}
+	coro_io_thread_destroy();
+	return NULL;
 }
 
-/** Remove a coroutine from the list. */
 static void
-coro_list_delete(struct coro *c)
+coro_finish(struct coro *c) __attribute__((noreturn));
+
+/**
+ * Finish the current coroutine @a c, if it is cancelled. Never
+ * returns then.
+ */
+static inline void
+coro_cancel_point(struct coro *c)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	if (atomic_load_explicit(&c->is_cancelled, memory_order_relaxed) &&
+	    c->is_cancellable) {
+		c->ret = -1;
+		coro_finish(c);
+	}
 }
 
-int
-coro_status(const struct coro *c)
+void
+coro_yield(void)
 {
-	return c->ret;
+	struct coro_worker *w = coro_worker_this();
+	coro_cancel_point(w->current);
+	/*
+	 * Check the I/O once per round over the run queue, so as
+	 * the coroutines with ready fds are not starved by the
+	 * busy ones.
+	 */
+	if (coro_io_has_waiters() &&
+	    ++w->yields_since_poll > w->run_queue.count) {
+		w->yields_since_poll = 0;
+		coro_io_poll(0);
+	}
+	struct coro *from = w->current;
+	struct coro_run_queue *q = &w->run_queue;
+	struct coro *to = NULL;
+	if (sched_wait_deadline != 0 && coro_ticks() >= sched_wait_deadline) {
+		/* coro_wait_timeout() has timed out. */
+		to = &main_worker.base;
+	} else {
+		coro_worker_lock(w);
+		if (q->policy->is_preempted(q, from))
+			to = coro_run_queue_pop(q);
+		coro_worker_unlock(w);
+	}
+	/* Nothing else to run first - continue the current one. */
+	if (to == NULL) {
+		/* A new time slice starts anyway. */
+		++from->switch_count;
+		coro_account_switch(from, from);
+		return;
+	}
+	coro_trace_ready(from);
+	/*
+	 * It is queued after the switch, when its run time of the
+	 * slice is accounted, see the fair policy.
+	 */
+	w->yielded = from;
+	coro_yield_to(to);
 }
 
-long long
-coro_switch_count(const struct coro *c)
+bool
+coro_yield_if_expired(void)
 {
-	return c->switch_count;
+	struct coro *c = coro_this();
+	if (coro_ticks() - c->switched_at < c->quantum)
+		return false;
+	coro_yield();
+	return true;
 }
 
-bool
-coro_is_finished(const struct coro *c)
+void
+coro_park(void)
 {
-	return c->is_finished;
+	coro_park_unlock(NULL);
 }
 
 void
-coro_delete(struct coro *c)
+coro_park_unlock(pthread_mutex_t *lock)
 {
-	free(c->stack);
-	free(c);
+	struct coro_worker *w = coro_worker_this();
+	struct coro *from = w->current;
+	coro_trace_event(CORO_TRACE_WAIT, from);
+	if (is_mt && from == &w->base) {
+		/*
+		 * The main thread does not run coroutines in the
+		 * multi-thread mode. It can only sleep until woken.
+		 * The wakeup is not lost - the idle sleep checks the
+		 * run queue.
+		 */
+		if (lock != NULL)
+			pthread_mutex_unlock(lock);
+		while (coro_worker_pop(w) != from)
+			coro_worker_idle(w);
+		return;
+	}
+	struct coro *to = coro_sched_next(w);
+	if (to == NULL) {
+		printf("Critical error - all coroutines are blocked!\n");
+		exit(-1);
+	}
+	if (to == from) {
+		if (lock != NULL)
+			pthread_mutex_unlock(lock);
+		return;
+	}
+	w->park_lock = lock;
+	coro_yield_to(to);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+void
+coro_wakeup(struct coro *c)
+{
+	coro_trace_event(CORO_TRACE_WAKEUP, c);
+	coro_trace_ready(c);
+	if (c == &main_worker.base) {
+		coro_worker_push(&main_worker, c);
+		return;
+	}
+	struct coro_worker *w = coro_worker_this();
+	if (! is_mt) {
+		coro_worker_push(w, c);
+	} else if (w == &main_worker) {
+		unsigned i = atomic_fetch_add(&next_worker, 1);
+		coro_worker_push(&workers[i % worker_count], c);
+	} else {
+		/* Keep it local, but let an idle worker steal it. */
+		coro_worker_push(w, c);
+		coro_worker_notify_idle();
+	}
+}
+
+/** Initialize the thread's scheduling state. */
 static void
-coro_yield_to(struct coro *to)
+coro_worker_create(struct coro_worker *w)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	memset(w, 0, sizeof(*w));
+	pthread_mutex_init(&w->lock, NULL);
+	coro_run_queue_create(&w->run_queue);
+	w->base.weight = 1;
+	w->base.sched_key = UINT64_MAX;
+	w->current = &w->base;
+	w->wakeup_fd = -1;
+	w->base.switched_at = coro_ticks();
+	/* Can't be cancelled, but can wait like the others. */
+	pthread_mutex_init(&w->base.wait_lock, NULL);
+	atomic_init(&w->is_idle, false);
 }
 
 void
-coro_yield(void)
+coro_sched_init(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	coro_ticks_calibrate();
+	coro_worker_create(&main_worker);
+	worker_this_ptr = &main_worker;
+	memset(&finished_queue, 0, sizeof(finished_queue));
+	coro_count = 0;
+	is_mt = false;
+}
+
+int
+coro_sched_init_threads(int thread_count)
+{
+	coro_sched_init();
+	if (thread_count <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	workers = calloc(thread_count, sizeof(*workers));
+	if (workers == NULL)
+		return -1;
+	worker_count = thread_count;
+	atomic_store(&is_stopping, false);
+	for (int i = -1; i < thread_count; ++i) {
+		struct coro_worker *w = i < 0 ? &main_worker : &workers[i];
+		if (i >= 0)
+			coro_worker_create(w);
+		w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (w->wakeup_fd < 0)
+			handle_error();
+	}
+	if (coro_io_thread_init(main_worker.wakeup_fd) != 0)
+		handle_error();
+	is_mt = true;
+	for (int i = 0; i < thread_count; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, coro_worker_f,
+				   &workers[i]) != 0)
+			handle_error();
+	}
+	return 0;
 }
 
 void
-coro_sched_init(void)
+coro_sched_destroy(void)
+{
+	if (is_mt) {
+		atomic_store(&is_stopping, true);
+		for (int i = 0; i < worker_count; ++i)
+			coro_worker_notify(&workers[i]);
+		/* Could be not idle yet, but about to be. */
+		for (int i = 0; i < worker_count; ++i) {
+			uint64_t one = 1;
+			if (write(workers[i].wakeup_fd, &one, sizeof(one)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+		}
+		for (int i = 0; i < worker_count; ++i) {
+			pthread_join(workers[i].thread, NULL);
+			close(workers[i].wakeup_fd);
+			pthread_mutex_destroy(&workers[i].lock);
+			coro_run_queue_destroy(&workers[i].run_queue);
+		}
+		free(workers);
+		workers = NULL;
+		worker_count = 0;
+		close(main_worker.wakeup_fd);
+		main_worker.wakeup_fd = -1;
+		is_mt = false;
+	}
+	coro_local_destroy(&main_worker.base.local);
+	coro_run_queue_destroy(&main_worker.run_queue);
+	coro_io_thread_destroy();
+}
+
+int
+coro_sched_set_policy(enum coro_sched_policy policy)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	if ((unsigned)policy >= lengthof(coro_policies)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (coro_count > 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	const struct coro_policy *p = &coro_policies[policy];
+	for (int i = -1; i < worker_count; ++i) {
+		struct coro_worker *w = i < 0 ? &main_worker : &workers[i];
+		coro_worker_lock(w);
+		w->run_queue.policy = p;
+		coro_worker_unlock(w);
+	}
+	return 0;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	return coro_wait_timeout(-1);
+}
+
+/** coro_wait_timeout() in the multi-thread mode. */
+static struct coro *
+coro_wait_timeout_mt(double timeout)
+{
+	struct timespec deadline;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		double sec = deadline.tv_nsec / 1e9 + timeout;
+		deadline.tv_sec += (time_t)sec;
+		deadline.tv_nsec = (sec - (time_t)sec) * 1e9;
+	}
+	pthread_mutex_lock(&sched_lock);
+	struct coro *c;
+	int rc = 0;
+	while ((c = coro_queue_pop(&finished_queue)) == NULL &&
+	       coro_count > 0 && rc != ETIMEDOUT) {
+		if (timeout < 0) {
+			pthread_cond_wait(&sched_cond, &sched_lock);
+			continue;
+		}
+		rc = pthread_cond_timedwait(&sched_cond, &sched_lock,
+					    &deadline);
+	}
+	if (c != NULL)
+		--coro_count;
+	pthread_mutex_unlock(&sched_lock);
+	if (c == NULL && rc == ETIMEDOUT)
+		errno = ETIMEDOUT;
+	return c;
+}
+
+struct coro *
+coro_wait_timeout(double timeout)
+{
+	if (is_mt)
+		return coro_wait_timeout_mt(timeout);
+	uint64_t deadline = 0;
+	if (timeout >= 0)
+		deadline = coro_ticks() + (uint64_t)(timeout * ticks_per_sec);
+	while (true) {
+		struct coro *c = coro_queue_pop(&finished_queue);
+		if (c != NULL) {
+			--coro_count;
+			return c;
+		}
+		if (deadline != 0 && coro_count == 0)
+			return NULL;
+		if (deadline != 0 && coro_ticks() >= deadline) {
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+		/*
+		 * The scheduler is not put into the run queue. It
+		 * gets control back only when a coroutine finishes,
+		 * or when the deadline passes and a coroutine yields
+		 * or parks.
+		 */
+		sched_wait_deadline = deadline;
+		struct coro *next = coro_sched_next(&main_worker);
+		if (next == NULL || next == &main_worker.base) {
+			sched_wait_deadline = 0;
+			if (next == NULL)
+				return NULL;
+			continue;
 		}
 		is_sched_waiting = true;
-		coro_yield_to(coro_list);
+		coro_yield_to(next);
 		is_sched_waiting = false;
+		sched_wait_deadline = 0;
 	}
-	return NULL;
 }
 
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	struct coro_worker *w = coro_worker_this();
+	/* Before coro_sched_init() or on a foreign thread. */
+	if (w == NULL)
+		return NULL;
+	return w->current;
+}
+
+struct coro_local *
+coro_local(struct coro *c)
+{
+	return &c->local;
+}
+
+struct coro_trace_stats *
+coro_trace_stats(const struct coro *c)
+{
+	return c->trace;
+}
+
+int
+coro_wait_begin(coro_wait_cancel_f cancel, void *arg)
+{
+	struct coro *c = coro_this();
+	int rc = 0;
+	pthread_mutex_lock(&c->wait_lock);
+	if (c->is_cancellable) {
+		if (atomic_load(&c->is_cancelled)) {
+			rc = -1;
+		} else {
+			c->wait_cancel = cancel;
+			c->wait_cancel_arg = arg;
+		}
+	}
+	pthread_mutex_unlock(&c->wait_lock);
+	if (rc != 0)
+		errno = ECANCELED;
+	return rc;
+}
+
+void
+coro_wait_end(void)
+{
+	struct coro *c = coro_this();
+	pthread_mutex_lock(&c->wait_lock);
+	c->wait_cancel = NULL;
+	pthread_mutex_unlock(&c->wait_lock);
+}
+
+/**
+ * Wake up a cancelled coroutine, if it is parked in a cancellable
+ * wait. The flag is set before, so as the wait either sees it in
+ * coro_wait_begin(), or is registered here.
+ */
+static void
+coro_wait_interrupt(struct coro *c)
+{
+	while (true) {
+		pthread_mutex_lock(&c->wait_lock);
+		if (c->wait_cancel == NULL ||
+		    c->wait_cancel(c->wait_cancel_arg)) {
+			c->wait_cancel = NULL;
+			pthread_mutex_unlock(&c->wait_lock);
+			return;
+		}
+		pthread_mutex_unlock(&c->wait_lock);
+		/* The waited object is busy in another thread. */
+		sched_yield();
+	}
+}
+
+/**
+ * Cancel the coroutine and its descendants. The ones, cancelled
+ * just now, are pushed to @a list to interrupt their waits. The
+ * subtree of an already cancelled one is cancelled too: its
+ * children got the flag then or on the creation.
+ */
+static void
+coro_cancel_tree(struct coro *c, struct coro **list)
+{
+	if (atomic_exchange(&c->is_cancelled, true))
+		return;
+	atomic_store(&c->is_interrupting, true);
+	c->next_interrupting = *list;
+	*list = c;
+	for (struct coro *child = c->first_child; child != NULL;
+	     child = child->next_sibling)
+		coro_cancel_tree(child, list);
+}
+
+int
+coro_cancel(struct coro *c)
+{
+	/* Scheduler contexts have no stack and can't be finished. */
+	if (c->stack == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct coro *list = NULL;
+	pthread_mutex_lock(&family_lock);
+	coro_cancel_tree(c, &list);
+	pthread_mutex_unlock(&family_lock);
+	/*
+	 * The interruption can wait for a lock of a waited object,
+	 * so it is done out of the family lock. A finished child
+	 * stays alive until is_interrupting is cleared.
+	 */
+	while (list != NULL) {
+		struct coro *next = list->next_interrupting;
+		coro_wait_interrupt(list);
+		atomic_store(&list->is_interrupting, false);
+		list = next;
+	}
+	return 0;
+}
+
+bool
+coro_is_cancelled(const struct coro *c)
+{
+	return atomic_load(&c->is_cancelled);
+}
+
+bool
+coro_set_cancellable(bool is_cancellable)
+{
+	struct coro *c = coro_this();
+	bool old = c->is_cancellable;
+	c->is_cancellable = is_cancellable;
+	return old;
+}
+
+void
+coro_testcancel(void)
+{
+	coro_cancel_point(coro_this());
+}
+
+void
+coro_wait_children(void)
+{
+	struct coro *c = coro_this();
+	pthread_mutex_lock(&family_lock);
+	while (c->first_child != NULL) {
+		c->is_waiting_children = true;
+		coro_park_unlock(&family_lock);
+		pthread_mutex_lock(&family_lock);
+	}
+	pthread_mutex_unlock(&family_lock);
+}
+
+/**
+ * Finish the current coroutine with the status in its 'ret' and
+ * switch away for good. The children are waited for first.
+ */
+static void
+coro_finish(struct coro *c)
+{
+	if (c->first_child != NULL)
+		coro_wait_children();
+	coro_family_leave(c);
+	coro_local_finish(&c->local);
+	coro_trace_event(CORO_TRACE_FINISH, c);
+	c->is_finished = true;
+	struct coro_worker *w = coro_worker_this();
+	struct coro *next;
+	if (c->is_generator && coro_is_mt_main(c->resumer)) {
+		/* Can be deleted right after the unlock. */
+		pthread_mutex_lock(&generator_lock);
+		w->park_lock = &generator_lock;
+		c->resumer->value = NULL;
+		c->resumer = NULL;
+		coro_wakeup(&main_worker.base);
+		next = coro_sched_next(w);
+	} else if (c->is_generator) {
+		/* The owner deletes it, the scheduler does not know it. */
+		next = c->resumer;
+		c->resumer = NULL;
+		next->value = NULL;
+	} else if (is_mt) {
+		w->finished = c;
+		next = coro_sched_next(w);
+	} else {
+		coro_queue_push(&finished_queue, c);
+		/*
+		 * Can not return - 'ret' address is invalid
+		 * already! Wake the scheduler up to reap the
+		 * coroutine. If it is not waiting, then it has
+		 * yielded and is in the run queue.
+		 */
+		next = &main_worker.base;
+		if (! is_sched_waiting)
+			next = coro_sched_next(w);
+	}
+	if (next == NULL) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	coro_account_switch(c, next);
+	w->current = next;
+	coro_transfer(c, next);
+	abort();
+}
+
+/**
+ * Run the coroutine function and return to the scheduler. Is
+ * called on the coroutine's own stack and never returns.
+ */
+static void
+coro_run(struct coro *c)
+{
+	coro_after_switch(coro_worker_this());
+	/* Cancelled before the start. */
+	coro_cancel_point(c);
+	c->ret = c->func(c->func_arg);
+	coro_finish(c);
+}
+
+#if CORO_SWITCH_ASM
+
+/**
+ * Build an initial frame on the coroutine stack so as the first
+ * switch into it starts coro_run(). No syscalls are needed.
+ */
+static void
+coro_stack_prepare(struct coro *c)
+{
+	uintptr_t top = (uintptr_t)c->stack->base + c->stack->size;
+	top &= ~(uintptr_t)15;
+	coro_ctx_prepare(c, (void *)top, coro_run);
 }
 
+#else /* CORO_SWITCH_SIGNAL */
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -160,8 +1794,8 @@ static void
 coro_body(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro *c = coro_creating;
+	coro_creating = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
@@ -172,30 +1806,17 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_run(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Remember a context on the coroutine stack by jumping onto it
+ * from a signal handler, executed on the alternative stack.
+ */
+static void
+coro_stack_prepare(struct coro *c)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
+	pthread_mutex_lock(&creation_lock);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -218,21 +1839,19 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_sp = c->stack->base;
+	newst.ss_size = c->stack->size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	coro_creating = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (coro_creating != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -251,8 +1870,193 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&creation_lock);
+}
+
+#endif /* CORO_SWITCH_SIGNAL */
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	attr->stack_size = CORO_STACK_SIZE_DEFAULT;
+	attr->quantum = 0.001;
+	attr->priority = 0;
+	attr->weight = 1;
+	attr->deadline = 0;
+	attr->is_child = false;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, NULL);
+}
+
+/** Create a coroutine, not known to the scheduler yet. */
+static struct coro *
+coro_create(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	struct coro_attr default_attr;
+	if (attr == NULL) {
+		coro_attr_create(&default_attr);
+		attr = &default_attr;
+	}
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->ret = 0;
+	size_t stack_size = coro_stack_size_for(func, attr->stack_size);
+	if (stack_size < (size_t)SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	c->stack = coro_stack_new(stack_size);
+	if (c->stack == NULL) {
+		free(c);
+		return NULL;
+	}
+	if (coro_stack_check_get() != CORO_STACK_CHECK_OFF)
+		coro_stack_paint(c->stack);
+	else
+		c->stack->is_painted = false;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->is_generator = false;
+	c->resumer = NULL;
+	c->value = NULL;
+	c->switch_count = 0;
+	c->run_ticks = 0;
+	c->wait_ticks = 0;
+	c->switched_at = coro_ticks();
+	c->quantum = attr->quantum * ticks_per_sec;
+	c->priority = attr->priority;
+	if (c->priority < 0)
+		c->priority = 0;
+	else if (c->priority > CORO_PRIORITY_MAX)
+		c->priority = CORO_PRIORITY_MAX;
+	c->weight = attr->weight > 0 ? attr->weight : 1;
+	c->deadline = attr->deadline * ticks_per_sec;
+	c->sched_key = UINT64_MAX;
+	c->sched_seq = 0;
+	c->vruntime_offset = 0;
+	atomic_init(&c->is_cancelled, false);
+	c->is_cancellable = true;
+	c->is_waiting_children = false;
+	c->wait_cancel = NULL;
+	c->wait_cancel_arg = NULL;
+	pthread_mutex_init(&c->wait_lock, NULL);
+	atomic_init(&c->is_interrupting, false);
+	c->next_interrupting = NULL;
+	c->parent = c->first_child = NULL;
+	c->next_sibling = c->prev_sibling = NULL;
+	coro_local_create(&c->local);
+	c->trace = NULL;
+	if (coro_trace_is_enabled()) {
+		c->trace = coro_trace_stats_new();
+		if (c->trace == NULL) {
+			coro_stack_delete(c->stack);
+			free(c);
+			return NULL;
+		}
+		coro_trace_event(CORO_TRACE_CREATE, c);
+	}
+	coro_stack_prepare(c);
+	struct coro *parent = coro_this();
+	/* Scheduler contexts do not own children. */
+	if (attr->is_child && parent->stack != NULL)
+		coro_family_join(c, parent);
+	return c;
+}
 
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	struct coro *c = coro_create(func, func_arg, attr);
+	if (c == NULL)
+		return NULL;
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	if (is_mt) {
+		pthread_mutex_lock(&sched_lock);
+		++coro_count;
+		pthread_mutex_unlock(&sched_lock);
+	} else {
+		++coro_count;
+	}
+	coro_wakeup(c);
+	return c;
+}
+
+struct coro *
+coro_new_generator(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	struct coro *c = coro_create(func, func_arg, attr);
+	if (c != NULL)
+		c->is_generator = true;
 	return c;
 }
+
+void *
+coro_resume(struct coro *c, void *in)
+{
+	if (! c->is_generator || c->resumer != NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (c->is_finished)
+		return NULL;
+	struct coro *from = coro_this();
+	c->value = in;
+	if (! coro_is_mt_main(from)) {
+		/* Run it right here, no scheduling. */
+		c->resumer = from;
+		coro_yield_to(c);
+		return from->value;
+	}
+	/*
+	 * The main thread does not run coroutines in the
+	 * multi-thread mode. Let a worker run the generator and
+	 * wait for its wakeup.
+	 */
+	pthread_mutex_lock(&generator_lock);
+	c->resumer = from;
+	coro_wakeup(c);
+	coro_park_unlock(&generator_lock);
+	/* Wait until the generator has switched away. */
+	pthread_mutex_lock(&generator_lock);
+	pthread_mutex_unlock(&generator_lock);
+	return from->value;
+}
+
+void *
+coro_yield_value(void *out)
+{
+	struct coro *c = coro_this();
+	if (! c->is_generator) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct coro *to = c->resumer;
+	if (! coro_is_mt_main(to)) {
+		c->resumer = NULL;
+		to->value = out;
+		coro_yield_to(to);
+		coro_cancel_point(c);
+		return c->value;
+	}
+	/*
+	 * The next resume can come only after the switch away,
+	 * when the lock is released.
+	 */
+	pthread_mutex_lock(&generator_lock);
+	c->resumer = NULL;
+	to->value = out;
+	coro_wakeup(to);
+	coro_park_unlock(&generator_lock);
+	coro_cancel_point(c);
+	return c->value;
+}
+
+void *
+coro_received(void)
+{
+	return coro_this()->value;
+}
@@ -1,14 +1,113 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
+enum {
+	/** Stack size of coroutines created by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Priorities are from 0 to this, see struct coro_attr. */
+	CORO_PRIORITY_MAX = 7,
+};
+
+/** Order, in which the ready coroutines run. */
+enum coro_sched_policy {
+	/** Round-robin in the order of becoming ready. */
+	CORO_SCHED_FIFO,
+	/**
+	 * Strict priorities: a coroutine runs only when no one with
+	 * a higher priority is ready. Round-robin within a priority.
+	 */
+	CORO_SCHED_PRIORITY,
+	/**
+	 * Weighted fair share: the one with the least run time,
+	 * divided by its weight, runs first. So the coroutines get
+	 * the CPU in proportion to their weights.
+	 */
+	CORO_SCHED_FAIR,
+	/**
+	 * Earliest deadline first. When a coroutine becomes ready
+	 * after a wait, its deadline is that moment plus its
+	 * relative deadline. Yields keep the deadline. The
+	 * coroutines without a deadline run after all the others.
+	 */
+	CORO_SCHED_EDF,
+};
+
+/** Optional coroutine parameters, see coro_new_ex(). */
+struct coro_attr {
+	/**
+	 * Stack size in bytes. Rounded up to a power of 2 pages.
+	 * The stack is committed lazily, so a big size costs only
+	 * virtual memory.
+	 */
+	size_t stack_size;
+	/**
+	 * Time slice in seconds for coro_yield_if_expired(). The
+	 * default is 1 ms.
+	 */
+	double quantum;
+	/**
+	 * Priority for CORO_SCHED_PRIORITY, from 0 to
+	 * CORO_PRIORITY_MAX. Bigger runs first. The default is 0.
+	 */
+	int priority;
+	/** Share for CORO_SCHED_FAIR, at least 1. The default is 1. */
+	unsigned weight;
+	/**
+	 * Relative deadline in seconds for CORO_SCHED_EDF. 0 means
+	 * no deadline, the default.
+	 */
+	double deadline;
+	/**
+	 * Make the new coroutine a child of the current one, like in
+	 * a nursery: cancellation of the parent cancels the child,
+	 * and the parent finishes only after its children return. Is
+	 * ignored outside of a coroutine. The default is false.
+	 */
+	bool is_child;
+};
+
+/** Fill the attributes with default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
+/**
+ * Make current context scheduler, but run the coroutines on
+ * @a thread_count worker threads instead of the current one. Each
+ * worker has its own run queue, idle workers steal coroutines
+ * from the busy ones. The current thread only creates and waits
+ * for the coroutines. A coroutine can move to another thread at
+ * any yield, so it should not rely on thread-local variables.
+ * @retval -1 Error. Check errno.
+ */
+int
+coro_sched_init_threads(int thread_count);
+
+/**
+ * Stop the worker threads, if any, and free the scheduler
+ * resources. All the coroutines should be finished and deleted.
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Choose the scheduling policy. The default one is
+ * CORO_SCHED_FIFO. Should be called after coro_sched_init*(),
+ * before any coroutine is created.
+ * @retval -1 Coroutines exist already, errno is EBUSY. Or an
+ *         unknown policy, errno is EINVAL.
+ */
+int
+coro_sched_set_policy(enum coro_sched_policy policy);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -16,7 +115,21 @@ coro_sched_init(void);
 struct coro *
 coro_sched_wait(void);
 
-/** Currently working coroutine. */
+/**
+ * Same as coro_sched_wait(), but wait not longer than @a timeout
+ * seconds. Negative means no timeout. In the single-thread mode
+ * the scheduler gets control back only when the running coroutine
+ * yields or parks, so the timeout can be exceeded by a time slice.
+ * @retval NULL No coroutines. Or the timeout has passed, errno is
+ *         ETIMEDOUT.
+ */
+struct coro *
+coro_wait_timeout(double timeout);
+
+/**
+ * Currently working coroutine. NULL before coro_sched_init() and
+ * on a thread, which is not the scheduler's.
+ */
 struct coro *
 coro_this(void);
 
@@ -27,13 +140,72 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with explicit attributes. NULL @a attr
+ * means defaults. Each stack has a guard page and takes 2 memory
+ * mappings, see vm.max_map_count.
+ * @retval NULL Memory error. Check errno.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/**
+ * Create a generator. It is not scheduled: it runs only inside
+ * coro_resume() until it yields a value or finishes. It is never
+ * returned by coro_sched_wait(), the owner deletes it.
+ * @retval NULL Memory error. Check errno.
+ */
+struct coro *
+coro_new_generator(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/**
+ * Run the generator until it yields a value, and return the value.
+ * @a in is returned to the generator by coro_yield_value(), or by
+ * coro_received() on the first resume. The generator can block
+ * inside, then the caller waits for it.
+ * @retval NULL The generator has finished, see coro_is_finished(),
+ *         or yielded NULL. Or it is not a generator or is resumed
+ *         already, errno is EINVAL.
+ */
+void *
+coro_resume(struct coro *c, void *in);
+
+/**
+ * Pass @a out to the coro_resume() of the current generator and
+ * suspend until it is resumed again.
+ * @return The value of the next coro_resume().
+ * @retval NULL Not a generator, errno is EINVAL.
+ */
+void *
+coro_yield_value(void *out);
+
+/** The value, passed by the last coro_resume() to the generator. */
+void *
+coro_received(void);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
 
+/**
+ * Number of the yields and the parks of the coroutine, including
+ * the yields, which have continued it, because nothing else was
+ * ready.
+ */
 long long
 coro_switch_count(const struct coro *c);
 
+/** Seconds the coroutine has been running, including now. */
+double
+coro_run_time(const struct coro *c);
+
+/**
+ * Seconds the coroutine has spent suspended: ready to run, or
+ * waiting for something.
+ */
+double
+coro_wait_time(const struct coro *c);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -42,6 +214,120 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to another not finished coroutine. Only to one, which
+ * should run before the current one by the scheduling policy.
+ * With FIFO that is any ready one.
+ */
 void
 coro_yield(void);
+
+/**
+ * Yield, if the current coroutine has been running longer than
+ * its quantum since it was resumed. Is cheap enough to be called
+ * in the hottest loops: it only reads the CPU cycle counter.
+ * @retval true Yielded.
+ */
+bool
+coro_yield_if_expired(void);
+
+/**
+ * Request cancellation of the coroutine and of all its children,
+ * see struct coro_attr.is_child. It is cooperative: the coroutine
+ * finishes with the status -1 at its next cancellation point, once
+ * its children have finished. The points are coro_yield(), and so
+ * coro_yield_if_expired() and the I/O calls, which yield,
+ * coro_yield_value() and coro_testcancel(). A coroutine, blocked
+ * in coro_sleep(), coro_wait_fd() or on a coro_sync.h object, is
+ * woken up, and the wait fails with errno ECANCELED, so as it can
+ * get to a point. Only coro_wait_children() is not interrupted. A
+ * not started one finishes without running its function. The
+ * stack is freed as usual by coro_delete().
+ * @retval -1 Not a coroutine, but a scheduler context, errno is
+ *         EINVAL.
+ */
+int
+coro_cancel(struct coro *c);
+
+/** True, if cancellation of the coroutine has been requested. */
+bool
+coro_is_cancelled(const struct coro *c);
+
+/**
+ * Enable or disable the cancellation points of the current
+ * coroutine. While disabled, a cancellation request is kept until
+ * they are enabled again.
+ * @return The previous state.
+ */
+bool
+coro_set_cancellable(bool is_cancellable);
+
+/** A cancellation point without a yield. */
+void
+coro_testcancel(void);
+
+/** Wait until all the children of the current coroutine finish. */
+void
+coro_wait_children(void);
+
+/** Memory usage of the coroutine stacks. */
+struct coro_stack_stats {
+	/** Stacks of not deleted coroutines. */
+	size_t used_count;
+	/** Stacks of deleted coroutines, kept for reuse. */
+	size_t cached_count;
+	/** Mapped memory of all the stacks, with guard pages. */
+	size_t virtual_size;
+	/** Memory of all the stacks really present in RAM. */
+	size_t resident_size;
+};
+
+/** Collect stack memory stats. Is O(number of stack pages). */
+void
+coro_stack_stats(struct coro_stack_stats *stats);
+
+/** Stack usage measurement, see coro_stack_check_set(). */
+enum coro_stack_check {
+	CORO_STACK_CHECK_OFF,
+	/**
+	 * New stacks are painted with a canary pattern. It commits
+	 * their memory. On coro_delete() the high-water mark is
+	 * found and accounted for the coroutine's entry function.
+	 */
+	CORO_STACK_CHECK_MEASURE,
+	/**
+	 * The same, and a new coroutine of a function, measured at
+	 * least once, gets a stack of its max usage with a margin
+	 * instead of the requested size. An unusually deep call
+	 * then hits the guard page and crashes.
+	 */
+	CORO_STACK_CHECK_ADAPTIVE,
+};
+
+/**
+ * Set the stack check mode. Affects the coroutines, created after
+ * the call.
+ */
+void
+coro_stack_check_set(enum coro_stack_check mode);
+
+/** Stack usage of the coroutines of one entry function. */
+struct coro_stack_usage {
+	coro_f func;
+	/** Measured coroutines. */
+	size_t count;
+	/** Max high-water mark in bytes. */
+	size_t max_used;
+	/** Sum of the high-water marks, for the average. */
+	size_t total_used;
+	/** Stack size, which the adaptive mode would give. */
+	size_t adaptive_size;
+};
+
+/**
+ * Get the stack usage per entry function into @a usage, at most
+ * @a count entries.
+ * @return Number of the functions, can be more than @a count.
+ */
+size_t
+coro_stack_usage(struct coro_stack_usage *usage, size_t count);
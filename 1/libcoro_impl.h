@@ -0,0 +1,169 @@
+#pragma once
+
+/*
+ * Interfaces between libcoro modules. Not for the library users.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "coro_trace.h"
+
+struct coro;
+struct coro_arena_chunk;
+struct coro_key_value;
+
+/** Arena and key values of a coroutine, see coro_local.h. */
+struct coro_local {
+	/** The chunk to allocate from. Older ones are linked to it. */
+	struct coro_arena_chunk *chunk;
+	/** Bytes given out by the arena. */
+	size_t arena_used;
+	/** Values of the keys, indexed by key. */
+	struct coro_key_value *values;
+	/** Size of the values array. */
+	unsigned value_count;
+};
+
+/** Local storage of a coroutine. */
+struct coro_local *
+coro_local(struct coro *c);
+
+void
+coro_local_create(struct coro_local *l);
+
+/**
+ * Call the key destructors for the values of a finishing
+ * coroutine. Is called on the coroutine's own stack.
+ */
+void
+coro_local_finish(struct coro_local *l);
+
+/** Free the arena and the values. */
+void
+coro_local_destroy(struct coro_local *l);
+
+/**
+ * Take the current coroutine out of scheduling and run others
+ * until somebody calls coro_wakeup() on it.
+ */
+void
+coro_park(void);
+
+/**
+ * Same as coro_park(), but @a lock is unlocked right after the
+ * switch away from the current coroutine. A waker should find the
+ * coroutine under the same lock. Then it can't wake the coroutine
+ * up before its context is saved, even from another thread.
+ */
+void
+coro_park_unlock(pthread_mutex_t *lock);
+
+/** Make a parked coroutine runnable again. */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Interrupt the wait of a cancelled coroutine: take it out of the
+ * waited object and wake it up. Is called by coro_cancel() in any
+ * thread, under the coroutine's wait lock. So it can't take a lock,
+ * which the waiting side holds when calling coro_wait_begin().
+ * @retval false A lock is busy, call again.
+ */
+typedef bool
+(*coro_wait_cancel_f)(void *arg);
+
+/**
+ * Register the wait of the current coroutine, which is going to
+ * park, so as coro_cancel() wakes it up with @a cancel(@a arg).
+ * Nothing is registered while the cancellation is disabled.
+ * @retval -1 Cancelled already, don't wait. Errno is ECANCELED.
+ */
+int
+coro_wait_begin(coro_wait_cancel_f cancel, void *arg);
+
+/**
+ * Unregister the wait after the wakeup. After that coro_cancel()
+ * does not touch the wait object anymore.
+ */
+void
+coro_wait_end(void);
+
+/** True, if there are coroutines waiting for I/O or timers. */
+bool
+coro_io_has_waiters(void);
+
+/**
+ * Wake up the coroutines whose fds are ready or timers expired.
+ * With a non-zero @a timeout the call sleeps until at least one of
+ * them is woken up, the thread's wakeup fd is signaled or the
+ * timeout in seconds passes. Negative means no timeout.
+ */
+void
+coro_io_poll(double timeout);
+
+/**
+ * Create the I/O state of a scheduler thread. Each thread has its
+ * own epoll set and timers. Writing to @a wakeup_fd (an eventfd)
+ * interrupts a blocking coro_io_poll() on that thread.
+ */
+int
+coro_io_thread_init(int wakeup_fd);
+
+/** Free the I/O state of the current thread. */
+void
+coro_io_thread_destroy(void);
+
+enum coro_trace_event_type {
+	CORO_TRACE_CREATE,
+	CORO_TRACE_SWITCH,
+	CORO_TRACE_FINISH,
+	/** The coroutine has parked to wait for something. */
+	CORO_TRACE_WAIT,
+	CORO_TRACE_WAKEUP,
+};
+
+/** True while tracing is on, see coro_trace.h. */
+extern atomic_bool coro_trace_is_on;
+
+static inline bool
+coro_trace_is_enabled(void)
+{
+	return atomic_load_explicit(&coro_trace_is_on, memory_order_relaxed);
+}
+
+/** Tracing state of a coroutine. */
+struct coro_trace_stats {
+	/** Id in the trace events. 0 is for the thread contexts. */
+	uint64_t id;
+	/** When the coroutine became ready to run. 0, if it is not. */
+	uint64_t ready_at;
+	struct coro_latency latency;
+};
+
+/** Tracing state of a coroutine. NULL, if it is not traced. */
+struct coro_trace_stats *
+coro_trace_stats(const struct coro *c);
+
+/** Allocate the tracing state for a new coroutine. */
+struct coro_trace_stats *
+coro_trace_stats_new(void);
+
+/**
+ * Record an event at the moment @a ticks of coro_ticks() on the
+ * thread number @a thread (0 is the main one). @a arg is the id of
+ * the coroutine, switched to, for a switch.
+ */
+void
+coro_trace_record(enum coro_trace_event_type type, uint64_t ticks,
+		  unsigned thread, uint64_t coro_id, uint64_t arg);
+
+/** Add a duration, measured in ticks, to the histogram. */
+void
+coro_histogram_add(struct coro_histogram *h, uint64_t ticks);
+
+/** Frequency of coro_ticks(). */
+double
+coro_ticks_per_sec(void);
@@ -1,12 +1,23 @@
+#include <fcntl.h>
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "coro_sync.h"
+#include "coro_trace.h"
 #include "libcoro.h"
+#include "sort.h"
 
 #define NS_PER_S 1e9
 #define NS_PER_MS 1e6
@@ -29,10 +40,18 @@ long time_between(struct timespec* end, struct timespec* start) {
            (end->tv_nsec - start->tv_nsec);
 }
 
-void swap(int* a, int* b) {
-    int temp = *a;
-    *a = *b;
-    *b = temp;
+// Writes the whole buffer, exits on failure.
+void write_all(int fd, const void* data, size_t size, const char* what) {
+    const char* p = data;
+    while (size > 0) {
+        ssize_t rc = write(fd, p, size);
+        if (rc < 0) {
+            printf("Failed to write %s: %s\n", what, strerror(errno));
+            exit(1);
+        }
+        p += rc;
+        size -= (size_t)rc;
+    }
 }
 
 /* Workers */
@@ -41,76 +60,97 @@ struct task {
     char* filepath;
     int* numbers;
     size_t numbers_count;
+    // a binary input mapped in place, the numbers point into it
+    void* mapping;
+    size_t mapping_size;
 };
 
 struct queue {
     struct task* tasks;
     size_t tasks_count;
-    size_t next_task;
+    // tasks not yet taken by workers, safe to use from any thread
+    struct coro_channel pending;
+    // with --procs the numbers of all tasks are in this shared mapping
+    void* shared;
+    size_t shared_size;
 };
 
-struct queue init_queue(char** filepaths, size_t tasks_count) {
-    struct queue queue = {
-        .tasks = calloc(tasks_count, sizeof(struct task)),
-        .tasks_count = tasks_count,
-        .next_task = 0,
-    };
-    if (queue.tasks == NULL) {
+void init_queue(struct queue* queue, char** filepaths, size_t tasks_count) {
+    queue->tasks = calloc(tasks_count, sizeof(struct task));
+    queue->tasks_count = tasks_count;
+    if (queue->tasks == NULL ||
+        coro_channel_create(&queue->pending, tasks_count) != 0) {
         puts("Failed to allocate memory for tasks");
         exit(2);
     }
     for (size_t i = 0; i < tasks_count; ++i) {
-        queue.tasks[i].filepath = filepaths[i];
-        queue.tasks[i].numbers = NULL;
-        queue.tasks[i].numbers_count = 0;
+        queue->tasks[i].filepath = filepaths[i];
+        queue->tasks[i].numbers = NULL;
+        queue->tasks[i].numbers_count = 0;
+        queue->tasks[i].mapping = NULL;
+        queue->tasks[i].mapping_size = 0;
     }
+    queue->shared = NULL;
+    queue->shared_size = 0;
+}
 
-    return queue;
+// Gives the workers every `step`-th task starting from `first`.
+void schedule_tasks(struct queue* queue, size_t first, size_t step) {
+    for (size_t i = first; i < queue->tasks_count; i += step) {
+        // never blocks, the channel fits all the tasks
+        coro_channel_send(&queue->pending, &queue->tasks[i]);
+    }
+    coro_channel_close(&queue->pending);
 }
 
 void free_queue(struct queue* queue) {
     for (size_t i = 0; i < queue->tasks_count; ++i) {
-        free(queue->tasks[i].numbers);
+        struct task* task = &queue->tasks[i];
+        if (task->mapping != NULL) {
+            munmap(task->mapping, task->mapping_size);
+        } else if (queue->shared == NULL) {
+            free(task->numbers);
+        }
+    }
+    if (queue->shared != NULL) {
+        munmap(queue->shared, queue->shared_size);
     }
     free(queue->tasks);
+    coro_channel_destroy(&queue->pending);
 }
 
+struct run_list;
+
 struct worker {
     struct queue* queue;
-    long quantum;
+    enum sort_algorithm algorithm;
+    // external mode only: numbers are collected here, sorted and
+    // spilled into a run when the buffer is full
+    struct run_list* runs;
+    int* run_numbers;
+    size_t run_count;
+    size_t run_capacity;
+    // filled from the libcoro stats when the worker finishes
     long work_time;
-    struct timespec resumed_at;
     size_t switches;
+    // with --trace only, in ns
+    bool is_traced;
+    uint64_t slice_p50;
+    uint64_t slice_p99;
+    uint64_t delay_p99;
 };
 
-void start_timer(struct worker* worker) {
-    clock_gettime(CLOCK_MONOTONIC, &worker->resumed_at);
-}
-
-void pause_timer(struct worker* worker) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    worker->work_time += time_between(&now, &worker->resumed_at);
-}
-
-void yield(struct worker* worker) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-
-    long time_spent = time_between(&now, &worker->resumed_at);
-    if (time_spent > worker->quantum) {
-        worker->work_time += time_spent;
-        coro_yield();
-        worker->switches = coro_switch_count(coro_this());
-        start_timer(worker);
-    }
-}
-
 static int worker(void* context);
 
 struct worker* init_workers(size_t workers_count, struct queue* queue,
-                            long target_latency) {
-    long quantum = target_latency * NS_PER_US / workers_count;
+                            long target_latency,
+                            enum sort_algorithm algorithm,
+                            struct run_list* runs, size_t run_capacity) {
+    // libcoro yields in coro_yield_if_expired() after this slice
+    struct coro_attr attr;
+    coro_attr_create(&attr);
+    attr.quantum = target_latency * NS_PER_US / workers_count / NS_PER_S;
+
     struct worker* workers = calloc(workers_count, sizeof(struct worker));
     if (workers == NULL) {
         puts("Failed to allocate memory for workers");
@@ -118,184 +158,1059 @@ struct worker* init_workers(size_t workers_count, struct queue* queue,
     }
     for (size_t i = 0; i < workers_count; ++i) {
         workers[i].queue = queue;
-        workers[i].quantum = quantum;
+        workers[i].algorithm = algorithm;
+        workers[i].runs = runs;
+        workers[i].run_numbers = NULL;
+        workers[i].run_count = 0;
+        workers[i].run_capacity = run_capacity;
+        if (runs != NULL) {
+            workers[i].run_numbers = malloc(run_capacity * sizeof(int));
+            if (workers[i].run_numbers == NULL) {
+                puts("Failed to allocate memory for workers");
+                exit(2);
+            }
+        }
         workers[i].work_time = 0;
         workers[i].switches = 0;
+        workers[i].is_traced = false;
 
-        coro_new(worker, &workers[i]);
+        if (coro_new_ex(worker, &workers[i], &attr) == NULL) {
+            puts("Failed to allocate memory for workers");
+            exit(2);
+        }
     }
     return workers;
 }
 
-/* Processing */
+/* Runs */
 
-size_t get_parent_index(size_t child) { return (child - 1) / 2; }
-size_t get_left_child_index(size_t parent) { return parent * 2 + 1; }
-size_t get_right_child_index(size_t parent) { return parent * 2 + 2; }
+// a run buffer must fit any parsed chunk, see load_numbers()
+#define MIN_RUN_CAPACITY (PARSE_CHUNK_SIZE / 2 + 1)
 
-void sift_down(int* numbers, size_t start, size_t heap_end) {
-    size_t root = start;
-    while (get_left_child_index(root) <= heap_end) {
-        size_t max = root;
+// A sorted run of numbers, spilled into an unlinked temporary file in
+// the binary form.
+struct run {
+    int fd;
+    size_t count;
+};
 
-        size_t left_child = get_left_child_index(root);
-        if (numbers[left_child] > numbers[max]) {
-            max = left_child;
-        }
+struct run_list {
+    struct run* runs;
+    // runs before `first` are merged already
+    size_t first;
+    size_t count;
+    size_t capacity;
+    // workers add runs concurrently
+    struct coro_mutex lock;
+};
 
-        size_t right_child = get_right_child_index(root);
-        if (right_child <= heap_end && numbers[right_child] > numbers[max]) {
-            max = right_child;
-        }
+void init_run_list(struct run_list* list) {
+    list->runs = NULL;
+    list->first = 0;
+    list->count = 0;
+    list->capacity = 0;
+    coro_mutex_create(&list->lock);
+}
 
-        if (max == root) {
-            break;
+void free_run_list(struct run_list* list) {
+    for (size_t i = list->first; i < list->count; ++i) {
+        close(list->runs[i].fd);
+    }
+    free(list->runs);
+    coro_mutex_destroy(&list->lock);
+}
+
+int create_temp_file(void) {
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sort-run-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Failed to create a temporary file in %s: %s\n", dir,
+               strerror(errno));
+        exit(1);
+    }
+    // the file lives until the fd is closed
+    unlink(path);
+    return fd;
+}
+
+void add_run(struct run_list* list, int fd, size_t count) {
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        perror("Failed to rewind a run");
+        exit(1);
+    }
+    coro_mutex_lock(&list->lock);
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->runs = realloc(list->runs, list->capacity * sizeof(struct run));
+        if (list->runs == NULL) {
+            puts("Failed to allocate memory for runs");
+            exit(2);
         }
+    }
+    list->runs[list->count].fd = fd;
+    list->runs[list->count].count = count;
+    ++list->count;
+    coro_mutex_unlock(&list->lock);
+}
 
-        swap(&numbers[root], &numbers[max]);
-        root = max;
+// Sorts the worker's buffer and moves it into a new run.
+void spill_run(struct worker* worker) {
+    if (worker->run_count == 0) {
+        return;
+    }
+    sort_numbers(worker->algorithm, worker->run_numbers, worker->run_count);
+    int fd = create_temp_file();
+    write_all(fd, worker->run_numbers, worker->run_count * sizeof(int),
+              "a run");
+    add_run(worker->runs, fd, worker->run_count);
+    worker->run_count = 0;
+    coro_yield_if_expired();
+}
+
+/* Binary format */
+
+// A file of 32-bit little-endian ints with a header:
+// 4 bytes magic, 4 bytes version, 8 bytes number count, all LE.
+#define BINARY_MAGIC "SI32"
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 16
+
+// the mapped numbers can be used as they are
+#define IS_NATIVE_LE (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+
+void make_binary_header(char* header, uint64_t count) {
+    uint32_t version = htole32(BINARY_VERSION);
+    count = htole64(count);
+    memcpy(header, BINARY_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &count, 8);
+}
+
+// Returns the number count, if the data starts with a valid header of
+// a file of this size. Otherwise -1, a text file too.
+ssize_t parse_binary_header(const char* data, size_t size) {
+    if (size < BINARY_HEADER_SIZE || memcmp(data, BINARY_MAGIC, 4) != 0) {
+        return -1;
+    }
+    uint32_t version;
+    uint64_t count;
+    memcpy(&version, data + 4, 4);
+    memcpy(&count, data + 8, 8);
+    count = le64toh(count);
+    if (le32toh(version) != BINARY_VERSION ||
+        count > (size - BINARY_HEADER_SIZE) / sizeof(int32_t)) {
+        return -1;
     }
+    return (ssize_t)count;
 }
 
-void build_heap(int* numbers, size_t heap_end) {
-    size_t parent = get_parent_index(heap_end);
+/* Input */
+
+// bytes parsed between checks whether the worker should yield, about
+// 30 us, which is a quantum of a 100 us target shared by 3 workers
+#define PARSE_CHUNK_SIZE (8 * 1024)
+// the parsed input is dropped from the memory in whole units of this,
+// which is a multiple of any page size
+#define DROP_CHUNK_SIZE (64 * 1024)
+
+#define REPEAT_BYTE(byte) (0x0101010101010101ULL * (byte))
+
+bool is_digit(char c) { return (unsigned char)(c - '0') < 10; }
+
+// Converts a run of up to 7 digits at once, 8 bytes must be readable
+// at `p`. Returns the number of digits converted, 0 if the run is too
+// long for the fast path.
+size_t parse_digits_swar(const char* p, uint64_t* value) {
+    uint64_t chunk;
+    memcpy(&chunk, p, sizeof(chunk));
+    // digits become 0..9 in each byte, other bytes get the high bit set
+    // either here or after adding 0x76. Borrows only go to the bytes
+    // after the first non-digit, which are discarded anyway.
+    chunk -= REPEAT_BYTE('0');
+    uint64_t non_digits =
+        (chunk | (chunk + REPEAT_BYTE(0x76))) & REPEAT_BYTE(0x80);
+    if (non_digits == 0) {
+        return 0;
+    }
+    size_t length = __builtin_ctzll(non_digits) / 8;
+    if (length == 0) {
+        return 0;
+    }
+    // leave only the digits, aligned as if there were leading zeros
+    chunk <<= 8 * (8 - length);
+    chunk = ((chunk & REPEAT_BYTE(0x0F)) * 2561) >> 8;
+    chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    chunk = ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    *value = chunk;
+    return length;
+}
+
+// Parses whitespace separated integers from [begin, end) into
+// `numbers`, which must have room for all of them. Returns the count.
+size_t parse_numbers(const char* begin, const char* end, int* numbers) {
+    size_t count = 0;
+    const char* p = begin;
     while (true) {
-        sift_down(numbers, parent, heap_end);
-        if (parent == 0) {
+        while (p < end && !is_digit(*p) && *p != '-') {
+            ++p;
+        }
+        if (p == end) {
             break;
         }
-        --parent;
+
+        bool is_negative = *p == '-';
+        if (is_negative) {
+            ++p;
+        }
+        const char* digits = p;
+        uint64_t value = 0;
+        size_t length = 0;
+        if (end - p >= 8) {
+            length = parse_digits_swar(p, &value);
+            p += length;
+        }
+        if (length == 0) {
+            while (p < end && is_digit(*p)) {
+                value = value * 10 + (uint64_t)(*p - '0');
+                ++p;
+            }
+        }
+        // a '-' without digits is a separator, so as the count stays
+        // within the buffer of size / 2 + 1
+        if (p > digits) {
+            numbers[count++] = (int)(is_negative ? -value : value);
+        }
     }
+    return count;
 }
 
-void heap_sort(struct task* task, struct worker* worker) {
-    if (task->numbers_count <= 1) {
-        return;
+// Takes the numbers of a mapped binary file. In memory the mapping is
+// made writable (copy-on-write) and sorted in place, nothing is read
+// or copied upfront. Otherwise the numbers are copied in chunks into
+// the shared slice or the run buffer.
+bool load_binary_numbers(struct worker* worker, struct task* task,
+                         char* data, size_t size, size_t count) {
+    const int32_t* source = (const int32_t*)(data + BINARY_HEADER_SIZE);
+    bool is_external = worker->runs != NULL;
+    if (!is_external && worker->queue->shared == NULL && IS_NATIVE_LE) {
+        if (mprotect(data, size, PROT_READ | PROT_WRITE) != 0) {
+            perror("Failed to map file");
+            munmap(data, size);
+            return false;
+        }
+        task->mapping = data;
+        task->mapping_size = size;
+        task->numbers = (int*)source;
+        task->numbers_count = count;
+        return true;
     }
 
-    size_t heap_end = task->numbers_count - 1;
-    build_heap(task->numbers, heap_end);
+    if (!is_external && task->numbers == NULL) {
+        task->numbers = malloc((count + 1) * sizeof(int));
+        if (task->numbers == NULL) {
+            puts("Failed to allocate memory for numbers");
+            exit(2);
+        }
+    }
+    size_t chunk_count = PARSE_CHUNK_SIZE / sizeof(int32_t);
+    for (size_t i = 0; i < count; i += chunk_count) {
+        size_t n = count - i < chunk_count ? count - i : chunk_count;
+        int* to;
+        if (is_external) {
+            if (worker->run_capacity - worker->run_count < n) {
+                spill_run(worker);
+            }
+            to = worker->run_numbers + worker->run_count;
+            worker->run_count += n;
+        } else {
+            to = task->numbers + task->numbers_count;
+            task->numbers_count += n;
+        }
+        for (size_t j = 0; j < n; ++j) {
+            to[j] = (int)le32toh((uint32_t)source[i + j]);
+        }
+        coro_yield_if_expired();
+    }
+    munmap(data, size);
+    return true;
+}
+
+// Maps the file and parses it chunk by chunk, letting other workers
+// run in between. In memory the array is sized by the worst case of
+// one-digit numbers, then shrunk. In the external mode the numbers go
+// to the worker's run buffer, and the parsed pages are dropped, so
+// the memory use does not depend on the file size.
+bool load_numbers(struct worker* worker, struct task* task) {
+    int fd = open(task->filepath, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to stat file");
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Failed to map file");
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    ssize_t binary_count = parse_binary_header(data, size);
+    if (binary_count >= 0) {
+        return load_binary_numbers(worker, task, data, size,
+                                   (size_t)binary_count);
+    }
+
+    bool is_external = worker->runs != NULL;
+    int* numbers;
+    size_t* count;
+    size_t capacity;
+    if (is_external) {
+        numbers = worker->run_numbers;
+        count = &worker->run_count;
+        capacity = worker->run_capacity;
+    } else {
+        // with --procs the array is in the shared mapping already
+        if (task->numbers == NULL) {
+            task->numbers = malloc((size / 2 + 1) * sizeof(int));
+        }
+        if (task->numbers == NULL) {
+            puts("Failed to allocate memory for numbers");
+            exit(2);
+        }
+        numbers = task->numbers;
+        count = &task->numbers_count;
+        capacity = size / 2 + 1;
+    }
 
-    while (heap_end > 0) {
-        swap(&task->numbers[0], &task->numbers[heap_end]);
-        --heap_end;
-        sift_down(task->numbers, 0, heap_end);
+    const char* end = data + size;
+    const char* chunk = data;
+    const char* dropped = data;
+    while (chunk < end) {
+        // cut the chunk after a separator, so as no number is split
+        const char* chunk_end = chunk + PARSE_CHUNK_SIZE;
+        if (chunk_end >= end) {
+            chunk_end = end;
+        } else {
+            while (chunk_end < end &&
+                   (is_digit(*chunk_end) || *chunk_end == '-')) {
+                ++chunk_end;
+            }
+        }
+        if (is_external &&
+            capacity - *count < (size_t)(chunk_end - chunk) / 2 + 1) {
+            spill_run(worker);
+        }
+        *count += parse_numbers(chunk, chunk_end, numbers + *count);
+        chunk = chunk_end;
+        if (is_external && chunk - dropped >= DROP_CHUNK_SIZE) {
+            // whole units are page aligned, as the mapping is
+            size_t length = (size_t)(chunk - dropped) / DROP_CHUNK_SIZE *
+                            DROP_CHUNK_SIZE;
+            madvise((void*)dropped, length, MADV_DONTNEED);
+            dropped += length;
+        }
+        coro_yield_if_expired();
+    }
+    munmap(data, size);
 
-        yield(worker);
+    if (!is_external && worker->queue->shared == NULL) {
+        int* shrunk = realloc(task->numbers,
+                              (task->numbers_count + 1) * sizeof(int));
+        if (shrunk != NULL) {
+            task->numbers = shrunk;
+        }
     }
+    return true;
 }
 
+/* Processing */
+
 static int worker(void* context) {
     struct worker* worker = context;
-    start_timer(worker);
 
     struct queue* queue = worker->queue;
-    while (queue->next_task != queue->tasks_count) {
-        struct task* task = &queue->tasks[queue->next_task];
-        ++queue->next_task;
+    void* next_task;
+    while (coro_channel_recv(&queue->pending, &next_task) == 0) {
+        struct task* task = next_task;
 
-        FILE* file = fopen(task->filepath, "r");
-        if (file == NULL) {
-            perror("Failed to open file");
+        if (!load_numbers(worker, task)) {
             continue;
         }
-
-        int number;
-        while (fscanf(file, "%d", &number) == 1) {
-            task->numbers =
-                realloc(task->numbers, (task->numbers_count + 1) * sizeof(int));
-            task->numbers[task->numbers_count] = number;
-            ++task->numbers_count;
+        if (worker->runs == NULL) {
+            sort_numbers(worker->algorithm, task->numbers,
+                         task->numbers_count);
         }
-        heap_sort(task, worker);
-        fclose(file);
+    }
+    if (worker->runs != NULL) {
+        spill_run(worker);
+        free(worker->run_numbers);
+        worker->run_numbers = NULL;
     }
 
-    pause_timer(worker);
+    struct coro* this = coro_this();
+    worker->work_time = (long)(coro_run_time(this) * NS_PER_S);
+    worker->switches = coro_switch_count(this);
+    struct coro_latency latency;
+    if (coro_latency(this, &latency) == 0) {
+        worker->is_traced = true;
+        worker->slice_p50 = coro_histogram_percentile(&latency.slice, 50);
+        worker->slice_p99 = coro_histogram_percentile(&latency.slice, 99);
+        worker->delay_p99 = coro_histogram_percentile(&latency.delay, 99);
+    }
     return 0;
 }
 
-void merge_results(struct queue* queue, FILE* output) {
-    size_t* positions = calloc(queue->tasks_count, sizeof(size_t));
-    if (positions == NULL) {
-        puts("Failed to allocate memory");
+/* Output */
+
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+// longest formatted int with a separator: "-2147483648 "
+#define MAX_NUMBER_LENGTH 12
+
+struct output {
+    int fd;
+    // ints for the runs and the binary result, text otherwise
+    bool is_binary;
+    // a run is read back by refill_cursor() as it is, in the native
+    // byte order, the binary result is little-endian
+    bool is_run;
+    // the buffer is the mapped file itself, sized exactly
+    bool is_mapped;
+    char* buffer;
+    size_t size;
+    // for the mapped file: where the mapping starts
+    char* mapping;
+    size_t mapping_size;
+};
+
+void init_output(struct output* output, int fd, bool is_binary) {
+    output->fd = fd;
+    output->is_binary = is_binary;
+    output->is_run = false;
+    output->is_mapped = false;
+    output->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    output->size = 0;
+    output->mapping = NULL;
+    output->mapping_size = 0;
+    if (output->buffer == NULL) {
+        puts("Failed to allocate memory for output");
         exit(2);
     }
+}
 
-    while (true) {
-        int min_element = INT_MIN;
-        size_t min_from = queue->tasks_count;
-        for (size_t i = 0; i < queue->tasks_count; ++i) {
-            if (positions[i] == queue->tasks[i].numbers_count) {
-                continue;
-            }
+// Binary result of `count` numbers: the file is resized and mapped, so
+// the merge stores the numbers right into the page cache.
+void init_mapped_output(struct output* output, int fd, size_t count) {
+    output->fd = fd;
+    output->is_binary = true;
+    output->is_run = false;
+    output->is_mapped = true;
+    output->mapping_size = BINARY_HEADER_SIZE + count * sizeof(int32_t);
+    if (ftruncate(fd, (off_t)output->mapping_size) != 0) {
+        perror("Failed to resize output");
+        exit(1);
+    }
+    output->mapping = mmap(NULL, output->mapping_size, PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+    if (output->mapping == MAP_FAILED) {
+        perror("Failed to map output");
+        exit(1);
+    }
+    make_binary_header(output->mapping, count);
+    output->buffer = output->mapping + BINARY_HEADER_SIZE;
+    output->size = 0;
+}
 
-            int this_element = queue->tasks[i].numbers[positions[i]];
-            if (min_from == queue->tasks_count || min_element > this_element) {
-                min_element = this_element;
-                min_from = i;
-            }
+// An intermediate run of the external merge, like the ones of
+// spill_run().
+void init_run_output(struct output* output, int fd) {
+    init_output(output, fd, true);
+    output->is_run = true;
+}
+
+void init_result_output(struct output* output, int fd, bool is_binary,
+                        size_t count) {
+    if (is_binary && IS_NATIVE_LE) {
+        init_mapped_output(output, fd, count);
+        return;
+    }
+    init_output(output, fd, false);
+    if (is_binary) {
+        char header[BINARY_HEADER_SIZE];
+        make_binary_header(header, count);
+        write_all(fd, header, sizeof(header), "output");
+        output->is_binary = true;
+    }
+}
+
+void flush_output(struct output* output) {
+    if (output->is_mapped) {
+        return;
+    }
+    write_all(output->fd, output->buffer, output->size, "output");
+    output->size = 0;
+}
+
+void free_output(struct output* output) {
+    if (output->is_mapped) {
+        munmap(output->mapping, output->mapping_size);
+        return;
+    }
+    flush_output(output);
+    free(output->buffer);
+}
+
+// Appends the number and a space to the buffer, digits are produced
+// from the end without any division by a variable.
+void write_number(struct output* output, int number) {
+    if (output->is_binary) {
+        if (!output->is_mapped &&
+            output->size + sizeof(number) > OUTPUT_BUFFER_SIZE) {
+            flush_output(output);
         }
-        if (min_from == queue->tasks_count) {
+        uint32_t value = (uint32_t)number;
+        if (!output->is_run) {
+            value = htole32(value);
+        }
+        memcpy(output->buffer + output->size, &value, sizeof(value));
+        output->size += sizeof(value);
+        return;
+    }
+    if (output->size + MAX_NUMBER_LENGTH > OUTPUT_BUFFER_SIZE) {
+        flush_output(output);
+    }
+    char digits[MAX_NUMBER_LENGTH];
+    char* p = digits + MAX_NUMBER_LENGTH;
+    *--p = ' ';
+    uint32_t value = number < 0 ? -(uint32_t)number : (uint32_t)number;
+    do {
+        *--p = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    if (number < 0) {
+        *--p = '-';
+    }
+    size_t length = (size_t)(digits + MAX_NUMBER_LENGTH - p);
+    memcpy(output->buffer + output->size, p, length);
+    output->size += length;
+}
+
+/* Merging */
+
+// read-ahead buffer of each run being merged
+#define RUN_BUFFER_SIZE (256 * 1024)
+
+// Head of a sorted sequence in the merge heap: a task in memory, or a
+// buffered part of a run.
+struct cursor {
+    const int* next;
+    const int* end;
+    // the run to refill the buffer from, NULL for tasks
+    struct run* run;
+    int* buffer;
+};
+
+// Reads the next part of the run into the cursor buffer. Returns false
+// at the end of the run.
+bool refill_cursor(struct cursor* cursor) {
+    size_t size = 0;
+    char* buffer = (char*)cursor->buffer;
+    while (size < RUN_BUFFER_SIZE) {
+        ssize_t rc = read(cursor->run->fd, buffer + size,
+                          RUN_BUFFER_SIZE - size);
+        if (rc < 0) {
+            perror("Failed to read a run");
+            exit(1);
+        }
+        if (rc == 0) {
             break;
         }
+        size += (size_t)rc;
+    }
+    cursor->next = cursor->buffer;
+    cursor->end = cursor->buffer + size / sizeof(int);
+    return cursor->next != cursor->end;
+}
+
+// Min-heap of cursors by their next number.
+void sift_down_cursors(struct cursor* heap, size_t start, size_t heap_size) {
+    size_t root = start;
+    struct cursor top = heap[start];
+    while (get_left_child_index(root) < heap_size) {
+        size_t min = get_left_child_index(root);
+        size_t right_child = get_right_child_index(root);
+        if (right_child < heap_size &&
+            *heap[right_child].next < *heap[min].next) {
+            min = right_child;
+        }
+        if (*top.next <= *heap[min].next) {
+            break;
+        }
+        heap[root] = heap[min];
+        root = min;
+    }
+    heap[root] = top;
+}
+
+// K-way merge of non-empty sorted cursors, O(log K) per number.
+void merge_cursors(struct cursor* heap, size_t heap_size,
+                   struct output* output) {
+    if (heap_size > 1) {
+        size_t parent = get_parent_index(heap_size - 1);
+        while (true) {
+            sift_down_cursors(heap, parent, heap_size);
+            if (parent == 0) {
+                break;
+            }
+            --parent;
+        }
+    }
 
-        ++positions[min_from];
-        fprintf(output, "%d ", min_element);
+    while (heap_size > 0) {
+        write_number(output, *heap[0].next);
+        if (++heap[0].next == heap[0].end &&
+            (heap[0].run == NULL || !refill_cursor(&heap[0]))) {
+            heap[0] = heap[--heap_size];
+        }
+        if (heap_size > 1) {
+            sift_down_cursors(heap, 0, heap_size);
+        }
     }
+}
 
-    fflush(output);
-    free(positions);
+void merge_results(struct queue* queue, int output_fd, bool is_binary) {
+    struct cursor* heap = calloc(queue->tasks_count + 1, sizeof(*heap));
+    if (heap == NULL) {
+        puts("Failed to allocate memory");
+        exit(2);
+    }
+    size_t heap_size = 0;
+    size_t total_count = 0;
+    for (size_t i = 0; i < queue->tasks_count; ++i) {
+        struct task* task = &queue->tasks[i];
+        if (task->numbers_count > 0) {
+            heap[heap_size].next = task->numbers;
+            heap[heap_size].end = task->numbers + task->numbers_count;
+            ++heap_size;
+            total_count += task->numbers_count;
+        }
+    }
+
+    struct output output;
+    init_result_output(&output, output_fd, is_binary, total_count);
+    merge_cursors(heap, heap_size, &output);
+    free_output(&output);
+    free(heap);
 }
 
-void print_stats(struct worker* workers, size_t workers_count,
-                 struct timespec* start, struct timespec* end) {
-    printf("Total work time: %fms\n",
-           (double)time_between(end, start) / NS_PER_MS);
+// Merges `count` runs from the head of the list into the output. Their
+// files are closed.
+void merge_run_files(struct run_list* list, size_t count,
+                     struct output* output) {
+    struct cursor* heap = calloc(count + 1, sizeof(*heap));
+    int* buffers = malloc(count * RUN_BUFFER_SIZE);
+    if (heap == NULL || (count > 0 && buffers == NULL)) {
+        puts("Failed to allocate memory");
+        exit(2);
+    }
+    size_t heap_size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct run* run = &list->runs[list->first + i];
+        // the kernel reads ahead more for sequential files
+        posix_fadvise(run->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        heap[heap_size].run = run;
+        heap[heap_size].buffer = buffers + i * (RUN_BUFFER_SIZE / sizeof(int));
+        if (refill_cursor(&heap[heap_size])) {
+            ++heap_size;
+        }
+    }
 
+    merge_cursors(heap, heap_size, output);
+    for (size_t i = 0; i < count; ++i) {
+        close(list->runs[list->first + i].fd);
+    }
+    list->first += count;
+    free(buffers);
+    free(heap);
+}
+
+// Merges the runs in passes of at most `fan_in` runs each, so as the
+// read buffers fit the memory budget, then the last ones into the
+// result.
+void merge_external(struct run_list* list, size_t memory_budget,
+                    int output_fd, bool is_binary) {
+    size_t fan_in = 2;
+    if (memory_budget > OUTPUT_BUFFER_SIZE + 2 * RUN_BUFFER_SIZE) {
+        fan_in = (memory_budget - OUTPUT_BUFFER_SIZE) / RUN_BUFFER_SIZE;
+    }
+    while (list->count - list->first > fan_in) {
+        int fd = create_temp_file();
+        size_t count = 0;
+        for (size_t i = 0; i < fan_in; ++i) {
+            count += list->runs[list->first + i].count;
+        }
+        struct output output;
+        init_run_output(&output, fd);
+        merge_run_files(list, fan_in, &output);
+        free_output(&output);
+        add_run(list, fd, count);
+    }
+
+    size_t total_count = 0;
+    for (size_t i = list->first; i < list->count; ++i) {
+        total_count += list->runs[i].count;
+    }
+    struct output output;
+    init_result_output(&output, output_fd, is_binary, total_count);
+    merge_run_files(list, list->count - list->first, &output);
+    free_output(&output);
+}
+
+void print_worker_stats(struct worker* workers, size_t workers_count) {
     for (size_t i = 0; i < workers_count; ++i) {
         printf("Coroutine %zu: worked for %fms, switched %zu times\n", i,
                (double)workers[i].work_time / NS_PER_MS, workers[i].switches);
+        if (workers[i].is_traced) {
+            printf("  slice p50 %.3fms, p99 %.3fms; delay p99 %.3fms\n",
+                   workers[i].slice_p50 / NS_PER_MS,
+                   workers[i].slice_p99 / NS_PER_MS,
+                   workers[i].delay_p99 / NS_PER_MS);
+        }
+    }
+}
+
+// Peak resident memory of this process in KiB, VmHWM from /proc. Unlike
+// the ru_maxrss of a waiting parent, it does not include the memory of
+// the launcher before exec(). Returns 0 if it is unknown.
+size_t read_peak_memory(void) {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[256];
+    size_t peak = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmHWM: %zu kB", &peak) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return peak;
+}
+
+// Stack high-water mark of the worker coroutines, with --stack-check.
+void print_stack_usage(void) {
+    struct coro_stack_usage usage;
+    if (coro_stack_usage(&usage, 1) == 0) {
+        return;
+    }
+    printf("Worker stacks: max %zu KiB, average %zu KiB of %d KiB\n",
+           usage.max_used >> 10, usage.total_used / usage.count >> 10,
+           CORO_STACK_SIZE_DEFAULT >> 10);
+}
+
+void print_usage(char* name) {
+    printf("Usage: %s [--threads N] [--sort heap|intro|radix|block] "
+           "[--memory MiB] [--procs N] [--binary] [--trace FILE] "
+           "[--stack-check] "
+           "target_latency workers "
+           "files...\n",
+           name);
+}
+
+struct options {
+    long target_latency;
+    size_t workers_count;
+    // 0 - coroutines run in the current thread
+    size_t threads_count;
+    enum sort_algorithm algorithm;
+    // 0 - everything is sorted in memory
+    size_t memory_budget;
+    // 0 - no sorter processes are forked
+    size_t procs_count;
+    // write the result in the binary format
+    bool is_binary;
+    // NULL - no scheduler trace is written
+    const char* trace_path;
+    // measure the stack usage of the workers
+    bool is_stack_checked;
+};
+
+// events kept by --trace, the older ones are dropped
+#define TRACE_CAPACITY (256 * 1024)
+
+// Sorts the scheduled tasks of the queue with a pool of worker
+// coroutines. Returns the workers with their stats.
+struct worker* run_workers(struct queue* queue, struct options* options,
+                           struct run_list* runs) {
+    if (options->is_stack_checked) {
+        coro_stack_check_set(CORO_STACK_CHECK_MEASURE);
+    }
+    if (options->threads_count > 0) {
+        if (coro_sched_init_threads((int)options->threads_count) != 0) {
+            perror("Failed to start worker threads");
+            exit(1);
+        }
+    } else {
+        coro_sched_init();
+    }
+
+    // External mode: half of the budget is for the run buffers, the
+    // other half for the radix sort buffers. The merge reads the runs
+    // with buffers of a fixed size, as many as fit the budget.
+    size_t run_capacity = 0;
+    if (options->memory_budget > 0) {
+        run_capacity =
+            options->memory_budget / 2 / options->workers_count / sizeof(int);
+        if (run_capacity < MIN_RUN_CAPACITY) {
+            run_capacity = MIN_RUN_CAPACITY;
+        }
+    }
+    if (options->trace_path != NULL && coro_trace_start(TRACE_CAPACITY) != 0) {
+        puts("Failed to allocate memory for the trace");
+        exit(2);
+    }
+    struct worker* workers = init_workers(
+        options->workers_count, queue, options->target_latency,
+        options->algorithm, options->memory_budget > 0 ? runs : NULL,
+        run_capacity);
+
+    struct coro* c;
+    while ((c = coro_sched_wait()) != NULL) {
+        coro_delete(c);
+    }
+    coro_sched_destroy();
+
+    if (options->trace_path != NULL) {
+        if (coro_trace_export(options->trace_path) != 0) {
+            perror("Failed to write the trace");
+        }
+        coro_trace_stop();
+    }
+    return workers;
+}
+
+// Forks the sorter processes. Each one sorts every procs_count-th file
+// with its own coroutine pool, right into a shared anonymous mapping.
+// So the parent gets the sorted numbers for the merge without pipes or
+// copying.
+void sort_in_processes(struct queue* queue, struct options* options) {
+    // the counts go first, then the numbers of each task, sized for the
+    // worst case like in load_numbers(). Untouched pages cost nothing.
+    size_t counts_size = queue->tasks_count * sizeof(size_t);
+    size_t* capacities = calloc(queue->tasks_count + 1, sizeof(size_t));
+    if (capacities == NULL) {
+        puts("Failed to allocate memory for tasks");
+        exit(2);
+    }
+    size_t numbers_count = 0;
+    for (size_t i = 0; i < queue->tasks_count; ++i) {
+        struct stat st;
+        size_t file_size = 0;
+        if (stat(queue->tasks[i].filepath, &st) == 0) {
+            file_size = (size_t)st.st_size;
+        }
+        capacities[i] = file_size / 2 + 1;
+        numbers_count += capacities[i];
+    }
+    queue->shared_size = counts_size + numbers_count * sizeof(int);
+    queue->shared = mmap(NULL, queue->shared_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (queue->shared == MAP_FAILED) {
+        perror("Failed to map shared memory");
+        exit(2);
+    }
+    size_t* counts = queue->shared;
+    int* numbers = (int*)((char*)queue->shared + counts_size);
+    for (size_t i = 0; i < queue->tasks_count; ++i) {
+        queue->tasks[i].numbers = numbers;
+        numbers += capacities[i];
+    }
+    free(capacities);
+
+    pid_t* pids = calloc(options->procs_count, sizeof(pid_t));
+    if (pids == NULL) {
+        puts("Failed to allocate memory for processes");
+        exit(2);
+    }
+    // or the buffered output would be printed by each child again
+    fflush(stdout);
+    for (size_t i = 0; i < options->procs_count; ++i) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("Failed to fork");
+            exit(1);
+        }
+        if (pids[i] > 0) {
+            continue;
+        }
+        schedule_tasks(queue, i, options->procs_count);
+        struct worker* workers = run_workers(queue, options, NULL);
+        for (size_t t = i; t < queue->tasks_count; t += options->procs_count) {
+            counts[t] = queue->tasks[t].numbers_count;
+        }
+        printf("Process %zu:\n", i);
+        print_worker_stats(workers, options->workers_count);
+        if (options->is_stack_checked) {
+            print_stack_usage();
+        }
+        printf("Peak memory: %zu KiB\n", read_peak_memory());
+        fflush(stdout);
+        _exit(0);
+    }
+
+    bool is_ok = true;
+    for (size_t i = 0; i < options->procs_count; ++i) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            is_ok = false;
+        }
+    }
+    free(pids);
+    if (!is_ok) {
+        puts("A sorter process failed");
+        exit(1);
+    }
+    for (size_t i = 0; i < queue->tasks_count; ++i) {
+        queue->tasks[i].numbers_count = counts[i];
     }
 }
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
-        char* name = (argc > 0) ? argv[0] : "./a.out";
-        printf("Usage: %s target_latency workers files...\n", name);
+    char* name = (argc > 0) ? argv[0] : "./a.out";
+    struct options options = {
+        .threads_count = 0,
+        .algorithm = SORT_HEAP,
+        .memory_budget = 0,
+        .procs_count = 0,
+        .is_binary = false,
+        .trace_path = NULL,
+        .is_stack_checked = false,
+    };
+
+    static struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"sort", required_argument, NULL, 's'},
+        {"memory", required_argument, NULL, 'm'},
+        {"procs", required_argument, NULL, 'p'},
+        {"binary", no_argument, NULL, 'b'},
+        {"trace", required_argument, NULL, 'T'},
+        {"stack-check", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "+t:s:m:p:bT:S", long_options,
+                                 NULL)) != -1) {
+        switch (option) {
+        case 't':
+            options.threads_count =
+                (size_t)parse_integer_argument(optarg, INT_MAX);
+            break;
+        case 's':
+            if (!parse_sort_algorithm(optarg, &options.algorithm)) {
+                printf("error: unknown sort algorithm %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            options.memory_budget =
+                (size_t)parse_integer_argument(optarg, SIZE_MAX >> 20) << 20;
+            break;
+        case 'p':
+            options.procs_count =
+                (size_t)parse_integer_argument(optarg, INT_MAX);
+            break;
+        case 'b':
+            options.is_binary = true;
+            break;
+        case 'T':
+            options.trace_path = optarg;
+            break;
+        case 'S':
+            options.is_stack_checked = true;
+            break;
+        default:
+            print_usage(name);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2) {
+        print_usage(name);
+        return 1;
+    }
+    if (options.procs_count > 0 && options.memory_budget > 0) {
+        puts("error: --procs can't be used with --memory");
+        return 1;
+    }
+    if (options.procs_count > 0 && options.trace_path != NULL) {
+        puts("error: --procs can't be used with --trace");
         return 1;
     }
-    size_t files_count = argc - 3;
-    long target_latency = (long)parse_integer_argument(argv[1], LONG_MAX);
-    size_t workers_count = (size_t)parse_integer_argument(argv[2], SIZE_MAX);
+    size_t files_count = argc - 2;
+    options.target_latency = (long)parse_integer_argument(argv[0], LONG_MAX);
+    options.workers_count = (size_t)parse_integer_argument(argv[1], SIZE_MAX);
 
     struct timespec start;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
-    FILE* output = fopen("output.txt", "w");
-    if (output == NULL) {
+    int output = open("output.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
         printf("Failed to open output.txt");
         return 1;
     }
 
-    coro_sched_init();
-    struct queue queue = init_queue(argv + 3, files_count);
-    struct worker* workers =
-        init_workers(workers_count, &queue, target_latency);
-
-    struct coro* c;
-    while ((c = coro_sched_wait()) != NULL) {
-        coro_delete(c);
+    struct queue queue;
+    init_queue(&queue, argv + 2, files_count);
+    struct run_list runs;
+    init_run_list(&runs);
+    struct worker* workers = NULL;
+    if (options.procs_count > 0) {
+        sort_in_processes(&queue, &options);
+    } else {
+        schedule_tasks(&queue, 0, 1);
+        workers = run_workers(&queue, &options, &runs);
     }
 
-    merge_results(&queue, output);
-    fclose(output);
+    if (options.memory_budget > 0) {
+        merge_external(&runs, options.memory_budget, output,
+                       options.is_binary);
+    } else {
+        merge_results(&queue, output, options.is_binary);
+    }
+    close(output);
 
     struct timespec end;
     clock_gettime(CLOCK_MONOTONIC, &end);
-    print_stats(workers, workers_count, &start, &end);
+    printf("Total work time: %fms\n",
+           (double)time_between(&end, &start) / NS_PER_MS);
+    if (workers != NULL) {
+        print_worker_stats(workers, options.workers_count);
+    }
+    if (workers != NULL && options.is_stack_checked) {
+        print_stack_usage();
+    }
+    printf("Peak memory: %zu KiB\n", read_peak_memory());
 
     free(workers);
     free_queue(&queue);
+    free_run_list(&runs);
     return 0;
 }
@@ -0,0 +1,356 @@
+#include "sort.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcoro.h"
+
+// ranges not longer than this are finished with insertion sort
+#define INSERTION_SORT_THRESHOLD 24
+// partitions at least this long end with a yield check
+#define YIELD_CHECK_MIN_SIZE 4096
+// elements processed between yield checks in the linear passes, a few
+// microseconds, well under a quantum of tens of microseconds
+#define YIELD_CHECK_STRIDE 1024
+// block size of the branchless partition, fits in L1 with the offsets
+#define PARTITION_BLOCK_SIZE 64
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
+
+static const char* algorithm_names[] = {
+    [SORT_HEAP] = "heap",
+    [SORT_INTRO] = "intro",
+    [SORT_RADIX] = "radix",
+    [SORT_BLOCK_QUICK] = "block",
+};
+
+bool parse_sort_algorithm(const char* name, enum sort_algorithm* algorithm) {
+    size_t count = sizeof(algorithm_names) / sizeof(algorithm_names[0]);
+    for (size_t i = 0; i < count; ++i) {
+        if (strcmp(name, algorithm_names[i]) == 0) {
+            *algorithm = (enum sort_algorithm)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* sort_algorithm_name(enum sort_algorithm algorithm) {
+    return algorithm_names[algorithm];
+}
+
+static void swap(int* a, int* b) {
+    int temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+/* Heap sort */
+
+size_t get_parent_index(size_t child) { return (child - 1) / 2; }
+size_t get_left_child_index(size_t parent) { return parent * 2 + 1; }
+size_t get_right_child_index(size_t parent) { return parent * 2 + 2; }
+
+static void sift_down(int* numbers, size_t start, size_t heap_end) {
+    size_t root = start;
+    while (get_left_child_index(root) <= heap_end) {
+        size_t max = root;
+
+        size_t left_child = get_left_child_index(root);
+        if (numbers[left_child] > numbers[max]) {
+            max = left_child;
+        }
+
+        size_t right_child = get_right_child_index(root);
+        if (right_child <= heap_end && numbers[right_child] > numbers[max]) {
+            max = right_child;
+        }
+
+        if (max == root) {
+            break;
+        }
+
+        swap(&numbers[root], &numbers[max]);
+        root = max;
+    }
+}
+
+static void build_heap(int* numbers, size_t heap_end) {
+    size_t parent = get_parent_index(heap_end);
+    while (true) {
+        sift_down(numbers, parent, heap_end);
+        if (parent == 0) {
+            break;
+        }
+        --parent;
+        // a sift is up to log(n) steps, and the check is one tick read
+        coro_yield_if_expired();
+    }
+}
+
+static void heap_sort(int* numbers, size_t count) {
+    if (count <= 1) {
+        return;
+    }
+
+    size_t heap_end = count - 1;
+    build_heap(numbers, heap_end);
+
+    while (heap_end > 0) {
+        swap(&numbers[0], &numbers[heap_end]);
+        --heap_end;
+        sift_down(numbers, 0, heap_end);
+        coro_yield_if_expired();
+    }
+}
+
+/* Quick sorts */
+
+static void insertion_sort(int* numbers, size_t count) {
+    for (size_t i = 1; i < count; ++i) {
+        int value = numbers[i];
+        size_t j = i;
+        while (j > 0 && numbers[j - 1] > value) {
+            numbers[j] = numbers[j - 1];
+            --j;
+        }
+        numbers[j] = value;
+    }
+}
+
+static void sort_three(int* numbers, size_t a, size_t b, size_t c) {
+    if (numbers[b] < numbers[a]) {
+        swap(&numbers[a], &numbers[b]);
+    }
+    if (numbers[c] < numbers[b]) {
+        swap(&numbers[b], &numbers[c]);
+    }
+    if (numbers[b] < numbers[a]) {
+        swap(&numbers[a], &numbers[b]);
+    }
+}
+
+// Moves a median of 3, or a pseudo-median of 9 for big ranges, to the
+// beginning.
+static void choose_pivot(int* numbers, size_t count) {
+    size_t middle = count / 2;
+    if (count > 128) {
+        size_t step = count / 8;
+        sort_three(numbers, 0, step, 2 * step);
+        sort_three(numbers, middle - step, middle, middle + step);
+        sort_three(numbers, count - 1 - 2 * step, count - 1 - step,
+                   count - 1);
+        sort_three(numbers, step, middle, count - 1 - step);
+    } else {
+        sort_three(numbers, 0, middle, count - 1);
+    }
+    swap(&numbers[0], &numbers[middle]);
+}
+
+// Finishes partitioning of [left, right] around the pivot. Elements
+// before `left` (except the pivot at 0) are not greater than it, after
+// `right` are not less. Returns the last index of the left part.
+static size_t partition_hoare(int* numbers, size_t left, size_t right) {
+    int pivot = numbers[0];
+    // right can be left - 1 for an empty range, so use signed indexes
+    ptrdiff_t lo = (ptrdiff_t)left;
+    ptrdiff_t hi = (ptrdiff_t)right;
+    while (true) {
+        while (lo <= hi && numbers[lo] < pivot) {
+            ++lo;
+        }
+        while (lo <= hi && numbers[hi] > pivot) {
+            --hi;
+        }
+        if (lo >= hi) {
+            break;
+        }
+        swap(&numbers[lo], &numbers[hi]);
+        ++lo;
+        --hi;
+    }
+    // lo == hi only on an element equal to the pivot
+    return (size_t)(lo > hi ? lo - 1 : lo);
+}
+
+// Block partition from BlockQuicksort (Edelkamp, Weiss): the positions
+// of misplaced elements are collected into offset buffers without
+// branches, then swapped in bulk. This takes comparisons off the
+// branch predictor, which fails half of the time on random data.
+static size_t partition_block(int* numbers, size_t count) {
+    int pivot = numbers[0];
+    uint8_t offsets_left[PARTITION_BLOCK_SIZE];
+    uint8_t offsets_right[PARTITION_BLOCK_SIZE];
+    size_t start_left = 0, start_right = 0;
+    size_t count_left = 0, count_right = 0;
+    int* left = numbers + 1;
+    int* right = numbers + count - 1;
+
+    while (right - left + 1 > 2 * PARTITION_BLOCK_SIZE) {
+        if (count_left == 0) {
+            start_left = 0;
+            for (size_t i = 0; i < PARTITION_BLOCK_SIZE; ++i) {
+                offsets_left[count_left] = (uint8_t)i;
+                count_left += left[i] >= pivot;
+            }
+        }
+        if (count_right == 0) {
+            start_right = 0;
+            for (size_t i = 0; i < PARTITION_BLOCK_SIZE; ++i) {
+                offsets_right[count_right] = (uint8_t)i;
+                count_right += *(right - i) <= pivot;
+            }
+        }
+        size_t swaps = count_left < count_right ? count_left : count_right;
+        for (size_t i = 0; i < swaps; ++i) {
+            swap(&left[offsets_left[start_left + i]],
+                 right - offsets_right[start_right + i]);
+        }
+        count_left -= swaps;
+        count_right -= swaps;
+        start_left += swaps;
+        start_right += swaps;
+        if (count_left == 0) {
+            left += PARTITION_BLOCK_SIZE;
+        }
+        if (count_right == 0) {
+            right -= PARTITION_BLOCK_SIZE;
+        }
+    }
+    // a block with unswapped elements is just scanned again
+    return partition_hoare(numbers, (size_t)(left - numbers),
+                           (size_t)(right - numbers));
+}
+
+static size_t partition_classic(int* numbers, size_t count) {
+    return partition_hoare(numbers, 1, count - 1);
+}
+
+static size_t log2_floor(size_t value) {
+    size_t result = 0;
+    while (value >>= 1) {
+        ++result;
+    }
+    return result;
+}
+
+// Introsort driver: quick sort, which falls back to heap sort when the
+// recursion gets too deep on a bad input. Recurses into the smaller
+// part, so the stack depth is O(log N).
+static void quick_sort(int* numbers, size_t count, size_t depth_limit,
+                       size_t (*partition)(int*, size_t)) {
+    while (count > INSERTION_SORT_THRESHOLD) {
+        if (depth_limit == 0) {
+            heap_sort(numbers, count);
+            return;
+        }
+        --depth_limit;
+
+        choose_pivot(numbers, count);
+        size_t middle = partition(numbers, count);
+        swap(&numbers[0], &numbers[middle]);
+        if (count >= YIELD_CHECK_MIN_SIZE) {
+            coro_yield_if_expired();
+        }
+
+        int* right = numbers + middle + 1;
+        size_t right_count = count - middle - 1;
+        if (middle < right_count) {
+            quick_sort(numbers, middle, depth_limit, partition);
+            numbers = right;
+            count = right_count;
+        } else {
+            quick_sort(right, right_count, depth_limit, partition);
+            count = middle;
+        }
+    }
+    insertion_sort(numbers, count);
+}
+
+/* Radix sort */
+
+// LSD radix sort by bytes. The sign bit is flipped, so negative
+// numbers go first. Passes, where all the numbers have the same byte,
+// are skipped.
+static void radix_sort(int* numbers, size_t count) {
+    if (count <= INSERTION_SORT_THRESHOLD) {
+        insertion_sort(numbers, count);
+        return;
+    }
+    uint32_t* buffer = malloc(count * sizeof(*buffer));
+    if (buffer == NULL) {
+        // not fatal, sort in place instead
+        quick_sort(numbers, count, 2 * log2_floor(count), partition_block);
+        return;
+    }
+
+    size_t counts[RADIX_PASSES][RADIX_BUCKETS];
+    memset(counts, 0, sizeof(counts));
+    uint32_t* from = (uint32_t*)numbers;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t key = from[i] ^ 0x80000000u;
+        for (size_t pass = 0; pass < RADIX_PASSES; ++pass) {
+            ++counts[pass][(key >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)];
+        }
+        if (i % YIELD_CHECK_STRIDE == YIELD_CHECK_STRIDE - 1) {
+            coro_yield_if_expired();
+        }
+    }
+
+    uint32_t* to = buffer;
+    for (size_t pass = 0; pass < RADIX_PASSES; ++pass) {
+        size_t shift = pass * RADIX_BITS;
+        size_t first_key = ((from[0] ^ 0x80000000u) >> shift) &
+                           (RADIX_BUCKETS - 1);
+        if (counts[pass][first_key] == count) {
+            continue;
+        }
+
+        size_t offsets[RADIX_BUCKETS];
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < RADIX_BUCKETS; ++bucket) {
+            offsets[bucket] = offset;
+            offset += counts[pass][bucket];
+        }
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t value = from[i];
+            size_t bucket =
+                ((value ^ 0x80000000u) >> shift) & (RADIX_BUCKETS - 1);
+            to[offsets[bucket]++] = value;
+            if (i % YIELD_CHECK_STRIDE == YIELD_CHECK_STRIDE - 1) {
+                coro_yield_if_expired();
+            }
+        }
+
+        uint32_t* temp = from;
+        from = to;
+        to = temp;
+    }
+
+    if (from != (uint32_t*)numbers) {
+        memcpy(numbers, from, count * sizeof(*numbers));
+    }
+    free(buffer);
+}
+
+void sort_numbers(enum sort_algorithm algorithm, int* numbers, size_t count) {
+    switch (algorithm) {
+    case SORT_HEAP:
+        heap_sort(numbers, count);
+        break;
+    case SORT_INTRO:
+        quick_sort(numbers, count, 2 * log2_floor(count + 1),
+                   partition_classic);
+        break;
+    case SORT_RADIX:
+        radix_sort(numbers, count);
+        break;
+    case SORT_BLOCK_QUICK:
+        quick_sort(numbers, count, 2 * log2_floor(count + 1),
+                   partition_block);
+        break;
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Sorting engines for the workers. All of them sort ints ascending in
+// place and call coro_yield_if_expired() between coarse chunks of work,
+// so they must run inside a coroutine.
+
+enum sort_algorithm {
+    SORT_HEAP,
+    SORT_INTRO,
+    SORT_RADIX,
+    SORT_BLOCK_QUICK,
+};
+
+// Looks up an algorithm by its command line name: heap, intro, radix or
+// block. Returns false if there is no such algorithm.
+bool parse_sort_algorithm(const char* name, enum sort_algorithm* algorithm);
+
+const char* sort_algorithm_name(enum sort_algorithm algorithm);
+
+void sort_numbers(enum sort_algorithm algorithm, int* numbers, size_t count);
+
+// Binary heap navigation, shared with the merge.
+size_t get_parent_index(size_t child);
+size_t get_left_child_index(size_t parent);
+size_t get_right_child_index(size_t parent);
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcoro.h"
+#include "sort.h"
+
+// Benchmark of the sorting engines on 1M numbers, the size of a big
+// input file. Each sort runs in a coroutine with its yield checks, but
+// alone, so the yields never switch. Build and run with
+// 'make bench_sort'.
+
+#define BENCH_COUNT (1000 * 1000)
+#define BENCH_REPEATS 3
+
+struct bench_run {
+    enum sort_algorithm algorithm;
+    int* numbers;
+    size_t count;
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sort_f(void* context) {
+    struct bench_run* run = context;
+    sort_numbers(run->algorithm, run->numbers, run->count);
+    return 0;
+}
+
+static void fill_uniform(int* numbers, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        numbers[i] = (int)(((unsigned)rand() << 16) ^ (unsigned)rand());
+    }
+}
+
+// like the files of generator.py with -m 100000, many duplicates
+static void fill_small(int* numbers, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        numbers[i] = rand() % 100001;
+    }
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+static void fill_sorted(int* numbers, size_t count) {
+    fill_uniform(numbers, count);
+    qsort(numbers, count, sizeof(*numbers), compare_ints);
+}
+
+static void fill_reversed(int* numbers, size_t count) {
+    fill_sorted(numbers, count);
+    for (size_t i = 0; i < count / 2; ++i) {
+        int temp = numbers[i];
+        numbers[i] = numbers[count - 1 - i];
+        numbers[count - 1 - i] = temp;
+    }
+}
+
+struct dataset {
+    const char* name;
+    void (*fill)(int*, size_t);
+};
+
+int main(void) {
+    const struct dataset datasets[] = {
+        {"uniform", fill_uniform},
+        {"small range", fill_small},
+        {"sorted", fill_sorted},
+        {"reversed", fill_reversed},
+    };
+    const enum sort_algorithm algorithms[] = {
+        SORT_HEAP,
+        SORT_INTRO,
+        SORT_BLOCK_QUICK,
+        SORT_RADIX,
+    };
+    int* source = malloc(BENCH_COUNT * sizeof(int));
+    int* expected = malloc(BENCH_COUNT * sizeof(int));
+    int* numbers = malloc(BENCH_COUNT * sizeof(int));
+    if (source == NULL || expected == NULL || numbers == NULL) {
+        puts("Failed to allocate memory");
+        return 2;
+    }
+
+    coro_sched_init();
+    struct coro_attr attr;
+    coro_attr_create(&attr);
+    attr.quantum = 1;
+
+    srand(42);
+    for (size_t d = 0; d < sizeof(datasets) / sizeof(datasets[0]); ++d) {
+        datasets[d].fill(source, BENCH_COUNT);
+        memcpy(expected, source, BENCH_COUNT * sizeof(int));
+        qsort(expected, BENCH_COUNT, sizeof(int), compare_ints);
+
+        printf("%s:\n", datasets[d].name);
+        for (size_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]);
+             ++a) {
+            double best = 0;
+            for (int r = 0; r < BENCH_REPEATS; ++r) {
+                memcpy(numbers, source, BENCH_COUNT * sizeof(int));
+                struct bench_run run = {algorithms[a], numbers, BENCH_COUNT};
+                double start = bench_now();
+                coro_new_ex(sort_f, &run, &attr);
+                coro_delete(coro_sched_wait());
+                double time = bench_now() - start;
+                if (r == 0 || time < best) {
+                    best = time;
+                }
+                if (memcmp(numbers, expected, BENCH_COUNT * sizeof(int)) !=
+                    0) {
+                    printf("%s sort is wrong\n",
+                           sort_algorithm_name(algorithms[a]));
+                    return 1;
+                }
+            }
+            printf("  %-6s %8.2f ms\n", sort_algorithm_name(algorithms[a]),
+                   best * 1e3);
+        }
+    }
+
+    coro_sched_destroy();
+    free(source);
+    free(expected);
+    free(numbers);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGNMENT alignof(max_align_t)
+
+struct arena_chunk {
+    struct arena_chunk* previous;
+    size_t size;
+    alignas(ARENA_ALIGNMENT) char data[];
+};
+
+void init_arena(struct arena* arena) {
+    arena->chunk = NULL;
+    arena->position = NULL;
+    arena->end = NULL;
+}
+
+size_t align_size(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+// chunks double, so a long line takes a few of them
+void add_chunk(struct arena* arena, size_t size) {
+    size_t chunk_size = ARENA_CHUNK_SIZE;
+    if (arena->chunk != NULL) {
+        chunk_size = arena->chunk->size * 2;
+    }
+    while (chunk_size < size) {
+        chunk_size *= 2;
+    }
+
+    struct arena_chunk* chunk = malloc(sizeof(*chunk) + chunk_size);
+    if (chunk == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+    chunk->previous = arena->chunk;
+    chunk->size = chunk_size;
+    arena->chunk = chunk;
+    arena->position = chunk->data;
+    arena->end = chunk->data + chunk_size;
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+    size = align_size(size);
+    if ((size_t)(arena->end - arena->position) < size) {
+        add_chunk(arena, size);
+    }
+    void* result = arena->position;
+    arena->position += size;
+    return result;
+}
+
+void* arena_realloc(struct arena* arena, void* pointer, size_t old_size,
+                    size_t new_size) {
+    old_size = align_size(old_size);
+    if (pointer != NULL && (char*)pointer + old_size == arena->position &&
+        (size_t)(arena->end - (char*)pointer) >= align_size(new_size)) {
+        arena->position = (char*)pointer + align_size(new_size);
+        return pointer;
+    }
+
+    void* result = arena_alloc(arena, new_size);
+    if (pointer != NULL) {
+        memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    }
+    return result;
+}
+
+struct arena_mark mark_arena(struct arena* arena) {
+    struct arena_mark mark = {.chunk = arena->chunk,
+                              .position = arena->position};
+    return mark;
+}
+
+void rewind_arena(struct arena* arena, struct arena_mark mark) {
+    while (arena->chunk != mark.chunk) {
+        struct arena_chunk* previous = arena->chunk->previous;
+        free(arena->chunk);
+        arena->chunk = previous;
+    }
+    if (arena->chunk == NULL) {
+        init_arena(arena);
+        return;
+    }
+    arena->position = mark.position;
+    arena->end = arena->chunk->data + arena->chunk->size;
+}
+
+void reset_arena(struct arena* arena) {
+    if (arena->chunk == NULL) {
+        return;
+    }
+
+    struct arena_chunk* chunk = arena->chunk->previous;
+    while (chunk != NULL) {
+        struct arena_chunk* previous = chunk->previous;
+        free(chunk);
+        chunk = previous;
+    }
+    arena->chunk->previous = NULL;
+    arena->position = arena->chunk->data;
+}
+
+void free_arena(struct arena* arena) {
+    reset_arena(arena);
+    free(arena->chunk);
+    init_arena(arena);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+// Bump allocator for everything parsed from one line: the command tree,
+// its arrays and its words. There is no per-object free, all the memory
+// is released at once.
+struct arena {
+    // the current chunk, the older ones are linked behind it
+    struct arena_chunk* chunk;
+    char* position;
+    char* end;
+};
+
+void init_arena(struct arena* arena);
+
+void* arena_alloc(struct arena* arena, size_t size);
+
+// Grows the last allocation in place when possible, otherwise copies it.
+void* arena_realloc(struct arena* arena, void* pointer, size_t old_size,
+                    size_t new_size);
+
+// A position in the arena, to free what is allocated after it.
+struct arena_mark {
+    struct arena_chunk* chunk;
+    char* position;
+};
+
+struct arena_mark mark_arena(struct arena* arena);
+
+// Frees everything allocated after the mark.
+void rewind_arena(struct arena* arena, struct arena_mark mark);
+
+// Frees everything allocated, but keeps the biggest chunk for reuse.
+void reset_arena(struct arena* arena);
+
+void free_arena(struct arena* arena);
@@ -0,0 +1,939 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "command.h"
+#include "path_table.h"
+
+extern char** environ;
+
+void init_builtin_output(struct builtin_output* output) {
+    output->buffer = NULL;
+    output->length = 0;
+    output->capacity = 0;
+}
+
+void free_builtin_output(struct builtin_output* output) {
+    free(output->buffer);
+    init_builtin_output(output);
+}
+
+void reserve_output(struct builtin_output* output, size_t size) {
+    size_t required_capacity = output->length + size;
+    if (required_capacity <= output->capacity) {
+        return;
+    }
+
+    size_t capacity = output->capacity == 0 ? 256 : output->capacity * 2;
+    if (capacity < required_capacity) {
+        capacity = required_capacity;
+    }
+    output->buffer = realloc(output->buffer, capacity);
+    if (output->buffer == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+    output->capacity = capacity;
+}
+
+void write_output(struct builtin_output* output, char* data, size_t size) {
+    // the buffer can be still NULL, and memcpy() does not take it
+    if (size == 0) {
+        return;
+    }
+
+    reserve_output(output, size);
+    memcpy(output->buffer + output->length, data, size);
+    output->length += size;
+}
+
+void write_output_char(struct builtin_output* output, char character) {
+    write_output(output, &character, 1);
+}
+
+void write_output_string(struct builtin_output* output, char* string) {
+    write_output(output, string, strlen(string));
+}
+
+void write_output_format(struct builtin_output* output, char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    va_list arguments_copy;
+    va_copy(arguments_copy, arguments);
+    int size = vsnprintf(NULL, 0, format, arguments_copy);
+    va_end(arguments_copy);
+
+    if (size > 0) {
+        // vsnprintf() writes the zero after the text too
+        reserve_output(output, (size_t)size + 1);
+        vsnprintf(output->buffer + output->length, (size_t)size + 1, format,
+                  arguments);
+        output->length += (size_t)size;
+    }
+    va_end(arguments);
+}
+
+struct execution_result exit_code_result(int exit_code) {
+    struct execution_result result = {.exit_code = exit_code,
+                                      .should_terminate = false};
+    return result;
+}
+
+struct execution_result execute_cd(struct simple_command* command,
+                                   struct execution_context* context,
+                                   struct builtin_output* output) {
+    (void)context;
+    (void)output;
+
+    if (command->words_count > 2) {
+        fprintf(stderr, "sush: cd: too many arguments\n");
+    }
+
+    char* new_cwd = NULL;
+    if (command->words_count == 1) {
+        new_cwd = getenv("HOME");
+    } else {
+        new_cwd = command->words[1];
+    }
+    if (new_cwd == NULL) {
+        return exit_code_result(0);
+    }
+
+    if (chdir(new_cwd) < 0) {
+        perror("sush: cd");
+        return exit_code_result(1);
+    }
+
+    return exit_code_result(0);
+}
+
+struct execution_result execute_exit(struct simple_command* command,
+                                     struct execution_context* context,
+                                     struct builtin_output* output) {
+    (void)output;
+
+    if (command->words_count > 2) {
+        fprintf(stderr, "sush: exit: too many arguments\n");
+        return exit_code_result(1);
+    }
+
+    struct execution_result result = {.exit_code = context->last_exit_code,
+                                      .should_terminate = true};
+    if (command->words_count == 2) {
+        int length;
+        int scanned =
+            sscanf(command->words[1], "%d%n", &result.exit_code, &length);
+        if (scanned < 1 || (size_t)length < strlen(command->words[1])) {
+            fprintf(stderr, "sush: exit: invalid number: %s\n",
+                    command->words[1]);
+            return exit_code_result(1);
+        }
+    }
+
+    return result;
+}
+
+struct execution_result execute_true(struct simple_command* command,
+                                     struct execution_context* context,
+                                     struct builtin_output* output) {
+    (void)command;
+    (void)context;
+    (void)output;
+    return exit_code_result(0);
+}
+
+struct execution_result execute_false(struct simple_command* command,
+                                      struct execution_context* context,
+                                      struct builtin_output* output) {
+    (void)command;
+    (void)context;
+    (void)output;
+    return exit_code_result(1);
+}
+
+bool is_octal_digit(char character) {
+    return character >= '0' && character <= '7';
+}
+
+int hex_digit_value(char character) {
+    if (character >= '0' && character <= '9') {
+        return character - '0';
+    }
+    if (character >= 'a' && character <= 'f') {
+        return character - 'a' + 10;
+    }
+    if (character >= 'A' && character <= 'F') {
+        return character - 'A' + 10;
+    }
+    return -1;
+}
+
+// Writes the escape after a backslash and moves past it. Returns false on
+// \c, which ends the output. An octal escape is \0nnn in 'echo -e' and
+// 'printf %b', and \nnn in a printf format.
+bool write_escape(struct builtin_output* output, char** string,
+                  bool is_format) {
+    char* input = *string;
+    char character = *input;
+    if (character == '\0') {
+        write_output_char(output, '\\');
+        return true;
+    }
+    ++input;
+
+    switch (character) {
+    case 'a':
+        write_output_char(output, '\a');
+        break;
+    case 'b':
+        write_output_char(output, '\b');
+        break;
+    case 'e':
+        write_output_char(output, '\033');
+        break;
+    case 'f':
+        write_output_char(output, '\f');
+        break;
+    case 'n':
+        write_output_char(output, '\n');
+        break;
+    case 'r':
+        write_output_char(output, '\r');
+        break;
+    case 't':
+        write_output_char(output, '\t');
+        break;
+    case 'v':
+        write_output_char(output, '\v');
+        break;
+    case '\\':
+        write_output_char(output, '\\');
+        break;
+    case 'c':
+        if (is_format) {
+            write_output(output, "\\c", 2);
+            break;
+        }
+        *string = input;
+        return false;
+    case 'x': {
+        int value = 0;
+        int digits = 0;
+        while (digits < 2 && hex_digit_value(*input) >= 0) {
+            value = value * 16 + hex_digit_value(*input);
+            ++input;
+            ++digits;
+        }
+        if (digits == 0) {
+            write_output(output, "\\x", 2);
+        } else {
+            write_output_char(output, (char)value);
+        }
+        break;
+    }
+    default:
+        if (is_octal_digit(character) && (is_format || character == '0')) {
+            int value = 0;
+            int digits = 0;
+            if (is_format) {
+                value = character - '0';
+                digits = 1;
+            }
+            while (digits < 3 && is_octal_digit(*input)) {
+                value = value * 8 + (*input - '0');
+                ++input;
+                ++digits;
+            }
+            write_output_char(output, (char)value);
+            break;
+        }
+
+        write_output_char(output, '\\');
+        write_output_char(output, character);
+    }
+
+    *string = input;
+    return true;
+}
+
+// Returns false on \c.
+bool write_escaped_string(struct builtin_output* output, char* string,
+                          bool is_format) {
+    while (*string != '\0') {
+        char* backslash = strchr(string, '\\');
+        if (backslash == NULL) {
+            write_output_string(output, string);
+            break;
+        }
+
+        write_output(output, string, (size_t)(backslash - string));
+        string = backslash + 1;
+        if (!write_escape(output, &string, is_format)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct execution_result execute_echo(struct simple_command* command,
+                                     struct execution_context* context,
+                                     struct builtin_output* output) {
+    (void)context;
+
+    bool should_end_line = true;
+    bool should_escape = false;
+    size_t first = 1;
+    // like in Bash, only the words of the option letters are options
+    for (; first < command->words_count; ++first) {
+        char* word = command->words[first];
+        if (word[0] != '-' || word[1] == '\0' ||
+            strspn(word + 1, "neE") != strlen(word + 1)) {
+            break;
+        }
+
+        for (char* option = word + 1; *option != '\0'; ++option) {
+            if (*option == 'n') {
+                should_end_line = false;
+            } else {
+                should_escape = *option == 'e';
+            }
+        }
+    }
+
+    for (size_t i = first; i < command->words_count; ++i) {
+        if (i > first) {
+            write_output_char(output, ' ');
+        }
+        if (!should_escape) {
+            write_output_string(output, command->words[i]);
+        } else if (!write_escaped_string(output, command->words[i], false)) {
+            return exit_code_result(0);
+        }
+    }
+
+    if (should_end_line) {
+        write_output_char(output, '\n');
+    }
+    return exit_code_result(0);
+}
+
+// Parses a printf number argument, which can also be a character after a
+// quote, like "'a". Sets the exit code on an invalid number.
+long long parse_printf_number(char* argument, int* exit_code) {
+    if (argument == NULL) {
+        return 0;
+    }
+    if (argument[0] == '\'' || argument[0] == '"') {
+        return (unsigned char)argument[1];
+    }
+
+    char* end;
+    errno = 0;
+    long long value = strtoll(argument, &end, 0);
+    while (isspace(*end)) {
+        ++end;
+    }
+    if (end == argument || *end != '\0' || errno != 0) {
+        fprintf(stderr, "sush: printf: %s: invalid number\n", argument);
+        *exit_code = 1;
+    }
+    return value;
+}
+
+struct execution_result execute_printf(struct simple_command* command,
+                                       struct execution_context* context,
+                                       struct builtin_output* output) {
+    (void)context;
+
+    if (command->words_count < 2) {
+        fprintf(stderr, "sush: printf: usage: printf format [arguments]\n");
+        return exit_code_result(2);
+    }
+
+    char* format = command->words[1];
+    char** arguments = command->words + 2;
+    size_t arguments_count = command->words_count - 2;
+    size_t next_argument = 0;
+    int exit_code = 0;
+
+    // the format is repeated while it takes the arguments
+    do {
+        size_t first_argument = next_argument;
+        char* input = format;
+        while (*input != '\0') {
+            if (*input == '\\') {
+                ++input;
+                write_escape(output, &input, true);
+                continue;
+            }
+            if (*input != '%') {
+                write_output_char(output, *input);
+                ++input;
+                continue;
+            }
+            if (input[1] == '%') {
+                write_output_char(output, '%');
+                input += 2;
+                continue;
+            }
+
+            // %[flags][width][.precision]conversion
+            char* specification_start = input;
+            ++input;
+            input += strspn(input, "-+ #0");
+            input += strspn(input, "0123456789");
+            if (*input == '.') {
+                ++input;
+                input += strspn(input, "0123456789");
+            }
+
+            char conversion = *input;
+            // the flags and the width, with the conversion and 'll' to add
+            char specification[64];
+            size_t specification_length =
+                (size_t)(input - specification_start);
+            if (conversion == '\0' || strchr("sbcdiouxX", conversion) == NULL ||
+                specification_length + 4 > sizeof(specification)) {
+                fprintf(stderr, "sush: printf: %s: invalid format\n", format);
+                return exit_code_result(1);
+            }
+            ++input;
+            memcpy(specification, specification_start, specification_length);
+
+            char* argument = NULL;
+            if (next_argument < arguments_count) {
+                argument = arguments[next_argument];
+                ++next_argument;
+            }
+
+            switch (conversion) {
+            case 's':
+            case 'b': {
+                struct builtin_output expanded;
+                init_builtin_output(&expanded);
+                bool should_continue = true;
+                if (argument != NULL && conversion == 'b') {
+                    should_continue =
+                        write_escaped_string(&expanded, argument, false);
+                } else if (argument != NULL) {
+                    write_output_string(&expanded, argument);
+                }
+
+                strcpy(specification + specification_length, "s");
+                write_output_char(&expanded, '\0');
+                write_output_format(output, specification, expanded.buffer);
+                free_builtin_output(&expanded);
+                if (!should_continue) {
+                    return exit_code_result(exit_code);
+                }
+                break;
+            }
+            case 'c':
+                if (argument != NULL && argument[0] != '\0') {
+                    strcpy(specification + specification_length, "c");
+                    write_output_format(output, specification, argument[0]);
+                }
+                break;
+            default:
+                specification[specification_length] = 'l';
+                specification[specification_length + 1] = 'l';
+                specification[specification_length + 2] = conversion;
+                specification[specification_length + 3] = '\0';
+                write_output_format(output, specification,
+                                    parse_printf_number(argument, &exit_code));
+            }
+        }
+
+        if (next_argument == first_argument) {
+            break;
+        }
+    } while (next_argument < arguments_count);
+
+    return exit_code_result(exit_code);
+}
+
+struct execution_result execute_pwd(struct simple_command* command,
+                                    struct execution_context* context,
+                                    struct builtin_output* output) {
+    (void)command;
+    (void)context;
+
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("sush: pwd");
+        return exit_code_result(1);
+    }
+
+    write_output_string(output, cwd);
+    write_output_char(output, '\n');
+    free(cwd);
+    return exit_code_result(0);
+}
+
+bool is_identifier(char* string, size_t length) {
+    if (length == 0 || isdigit(string[0])) {
+        return false;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (!isalnum(string[i]) && string[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// There are no shell variables, so export sets the environment, which the
+// commands inherit.
+struct execution_result execute_export(struct simple_command* command,
+                                       struct execution_context* context,
+                                       struct builtin_output* output) {
+    (void)context;
+
+    if (command->words_count == 1) {
+        for (char** variable = environ; *variable != NULL; ++variable) {
+            char* value = strchr(*variable, '=');
+            if (value == NULL) {
+                continue;
+            }
+
+            write_output_string(output, "export ");
+            write_output(output, *variable, (size_t)(value - *variable));
+            write_output(output, "=\"", 2);
+            for (char* character = value + 1; *character != '\0';
+                 ++character) {
+                if (strchr("\"\\$`", *character) != NULL) {
+                    write_output_char(output, '\\');
+                }
+                write_output_char(output, *character);
+            }
+            write_output(output, "\"\n", 2);
+        }
+        return exit_code_result(0);
+    }
+
+    int exit_code = 0;
+    for (size_t i = 1; i < command->words_count; ++i) {
+        char* word = command->words[i];
+        char* equals = strchr(word, '=');
+        size_t name_length = equals == NULL ? strlen(word)
+                                            : (size_t)(equals - word);
+        if (!is_identifier(word, name_length)) {
+            fprintf(stderr, "sush: export: `%s': not a valid identifier\n",
+                    word);
+            exit_code = 1;
+            continue;
+        }
+        if (equals == NULL) {
+            continue;
+        }
+
+        // the words are not shared, so the name is cut in place
+        *equals = '\0';
+        int result = setenv(word, equals + 1, 1);
+        *equals = '=';
+        if (result < 0) {
+            perror("sush: export");
+            exit_code = 1;
+        }
+    }
+
+    return exit_code_result(exit_code);
+}
+
+// test and [ parse their words with this recursive descent:
+//   or := and ('-o' and)*
+//   and := not ('-a' not)*
+//   not := '!' not | primary
+//   primary := '(' or ')' | word binary word | unary word | word
+struct test_parser {
+    char** words;
+    size_t words_count;
+    size_t position;
+    char* name;
+    bool has_error;
+};
+
+bool is_test_unary_operator(char* word) {
+    return word[0] == '-' && word[1] != '\0' && word[2] == '\0' &&
+           strchr("bcdefhLnprsStwxz", word[1]) != NULL;
+}
+
+bool is_test_binary_operator(char* word) {
+    char* operators[] = {"=",   "==",  "!=",  "<",   ">",   "-eq", "-ne",
+                         "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for (size_t i = 0; i < sizeof(operators) / sizeof(*operators); ++i) {
+        if (strcmp(word, operators[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the number of words left
+size_t test_words_left(struct test_parser* parser) {
+    return parser->words_count - parser->position;
+}
+
+char* peek_test_word(struct test_parser* parser, size_t offset) {
+    if (offset >= test_words_left(parser)) {
+        return NULL;
+    }
+    return parser->words[parser->position + offset];
+}
+
+void test_error(struct test_parser* parser, char* message, char* word) {
+    if (!parser->has_error) {
+        fprintf(stderr, "sush: %s: %s%s\n", parser->name,
+                word == NULL ? "" : word, message);
+    }
+    parser->has_error = true;
+}
+
+long long parse_test_integer(struct test_parser* parser, char* word) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(word, &end, 10);
+    while (isspace(*end)) {
+        ++end;
+    }
+    if (end == word || *end != '\0' || errno != 0) {
+        test_error(parser, ": integer expression expected", word);
+    }
+    return value;
+}
+
+bool test_unary(char operator, char* operand) {
+    struct stat file_stat;
+    switch (operator) {
+    case 'n':
+        return operand[0] != '\0';
+    case 'z':
+        return operand[0] == '\0';
+    case 'r':
+        return access(operand, R_OK) == 0;
+    case 'w':
+        return access(operand, W_OK) == 0;
+    case 'x':
+        return access(operand, X_OK) == 0;
+    case 't':
+        return isatty(atoi(operand));
+    case 'h':
+    case 'L':
+        return lstat(operand, &file_stat) == 0 && S_ISLNK(file_stat.st_mode);
+    }
+
+    if (stat(operand, &file_stat) < 0) {
+        return false;
+    }
+    switch (operator) {
+    case 'b':
+        return S_ISBLK(file_stat.st_mode);
+    case 'c':
+        return S_ISCHR(file_stat.st_mode);
+    case 'd':
+        return S_ISDIR(file_stat.st_mode);
+    case 'f':
+        return S_ISREG(file_stat.st_mode);
+    case 'p':
+        return S_ISFIFO(file_stat.st_mode);
+    case 's':
+        return file_stat.st_size > 0;
+    case 'S':
+        return S_ISSOCK(file_stat.st_mode);
+    default:
+        // 'e'
+        return true;
+    }
+}
+
+// Compares the modification times: -1, 0 or 1, or -2 if a file is
+// missing.
+int compare_file_times(char* first, char* second, bool* are_same) {
+    struct stat first_stat;
+    struct stat second_stat;
+    bool has_first = stat(first, &first_stat) == 0;
+    bool has_second = stat(second, &second_stat) == 0;
+    *are_same = has_first && has_second &&
+                first_stat.st_dev == second_stat.st_dev &&
+                first_stat.st_ino == second_stat.st_ino;
+    if (!has_first || !has_second) {
+        return has_first ? 1 : -1;
+    }
+
+    struct timespec first_time = first_stat.st_mtim;
+    struct timespec second_time = second_stat.st_mtim;
+    if (first_time.tv_sec != second_time.tv_sec) {
+        return first_time.tv_sec < second_time.tv_sec ? -1 : 1;
+    }
+    if (first_time.tv_nsec != second_time.tv_nsec) {
+        return first_time.tv_nsec < second_time.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+bool test_binary(struct test_parser* parser, char* left, char* operator,
+                 char* right) {
+    if (strcmp(operator, "=") == 0 || strcmp(operator, "==") == 0) {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(operator, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    }
+    if (strcmp(operator, "<") == 0) {
+        return strcmp(left, right) < 0;
+    }
+    if (strcmp(operator, ">") == 0) {
+        return strcmp(left, right) > 0;
+    }
+
+    if (strcmp(operator, "-nt") == 0 || strcmp(operator, "-ot") == 0 ||
+        strcmp(operator, "-ef") == 0) {
+        bool are_same;
+        int order = compare_file_times(left, right, &are_same);
+        if (operator[1] == 'e') {
+            return are_same;
+        }
+        return operator[1] == 'n' ? order > 0 : order < 0;
+    }
+
+    long long left_number = parse_test_integer(parser, left);
+    long long right_number = parse_test_integer(parser, right);
+    if (strcmp(operator, "-eq") == 0) {
+        return left_number == right_number;
+    }
+    if (strcmp(operator, "-ne") == 0) {
+        return left_number != right_number;
+    }
+    if (strcmp(operator, "-lt") == 0) {
+        return left_number < right_number;
+    }
+    if (strcmp(operator, "-le") == 0) {
+        return left_number <= right_number;
+    }
+    if (strcmp(operator, "-gt") == 0) {
+        return left_number > right_number;
+    }
+    return left_number >= right_number;
+}
+
+bool parse_test_or(struct test_parser* parser);
+
+bool parse_test_primary(struct test_parser* parser) {
+    char* word = peek_test_word(parser, 0);
+    if (word == NULL) {
+        test_error(parser, "argument expected", NULL);
+        return false;
+    }
+
+    char* next = peek_test_word(parser, 1);
+    if (next != NULL && is_test_binary_operator(next) &&
+        test_words_left(parser) >= 3) {
+        char* right = peek_test_word(parser, 2);
+        parser->position += 3;
+        return test_binary(parser, word, next, right);
+    }
+
+    if (strcmp(word, "(") == 0 && next != NULL) {
+        ++parser->position;
+        bool value = parse_test_or(parser);
+        char* closing = peek_test_word(parser, 0);
+        if (closing == NULL || strcmp(closing, ")") != 0) {
+            test_error(parser, "`)' expected", NULL);
+            return false;
+        }
+        ++parser->position;
+        return value;
+    }
+
+    if (is_test_unary_operator(word) && next != NULL) {
+        parser->position += 2;
+        return test_unary(word[1], next);
+    }
+
+    ++parser->position;
+    return word[0] != '\0';
+}
+
+bool parse_test_not(struct test_parser* parser) {
+    char* word = peek_test_word(parser, 0);
+    char* next = peek_test_word(parser, 1);
+    // in '! = x' the '!' is a word to compare
+    if (word != NULL && strcmp(word, "!") == 0 && next != NULL &&
+        !(is_test_binary_operator(next) && test_words_left(parser) == 3)) {
+        ++parser->position;
+        return !parse_test_not(parser);
+    }
+    return parse_test_primary(parser);
+}
+
+bool parse_test_and(struct test_parser* parser) {
+    bool value = parse_test_not(parser);
+    char* word;
+    while ((word = peek_test_word(parser, 0)) != NULL &&
+           strcmp(word, "-a") == 0) {
+        ++parser->position;
+        // both sides are parsed for the syntax errors
+        bool right = parse_test_not(parser);
+        value = value && right;
+    }
+    return value;
+}
+
+bool parse_test_or(struct test_parser* parser) {
+    bool value = parse_test_and(parser);
+    char* word;
+    while ((word = peek_test_word(parser, 0)) != NULL &&
+           strcmp(word, "-o") == 0) {
+        ++parser->position;
+        bool right = parse_test_and(parser);
+        value = value || right;
+    }
+    return value;
+}
+
+struct execution_result execute_test(struct simple_command* command,
+                                     struct execution_context* context,
+                                     struct builtin_output* output) {
+    (void)context;
+    (void)output;
+
+    struct test_parser parser = {.words = command->words + 1,
+                                 .words_count = command->words_count - 1,
+                                 .position = 0,
+                                 .name = command->words[0],
+                                 .has_error = false};
+    if (strcmp(command->words[0], "[") == 0) {
+        if (parser.words_count == 0 ||
+            strcmp(parser.words[parser.words_count - 1], "]") != 0) {
+            fprintf(stderr, "sush: [: missing `]'\n");
+            return exit_code_result(2);
+        }
+        --parser.words_count;
+    }
+
+    // no expression is false
+    if (parser.words_count == 0) {
+        return exit_code_result(1);
+    }
+
+    bool value = parse_test_or(&parser);
+    if (!parser.has_error && parser.position < parser.words_count) {
+        test_error(&parser, ": unexpected argument",
+                   parser.words[parser.position]);
+    }
+    if (parser.has_error) {
+        return exit_code_result(2);
+    }
+    return exit_code_result(value ? 0 : 1);
+}
+
+void write_path_table(struct path_table* table,
+                      struct builtin_output* output) {
+    // the entries found in the old PATH are not used anymore
+    check_path_variable(table);
+    if (table->entries_count == 0) {
+        write_output_string(output, "hash: hash table empty\n");
+        return;
+    }
+
+    write_output_string(output, "hits\tcommand\n");
+    for (size_t i = 0; i < table->buckets_count; ++i) {
+        for (struct path_entry* entry = table->buckets[i]; entry != NULL;
+             entry = entry->next) {
+            write_output_format(output, "%4zu\t%s\n", entry->hits,
+                                entry->path);
+        }
+    }
+}
+
+// 'hash' lists the paths of the commands, 'hash -r' forgets them,
+// 'hash name...' searches PATH for the commands, and 'hash -s' prints
+// the hits and the misses of the lookups.
+struct execution_result execute_hash(struct simple_command* command,
+                                     struct execution_context* context,
+                                     struct builtin_output* output) {
+    struct path_table* table = &context->path_table;
+    if (command->words_count == 1) {
+        write_path_table(table, output);
+        return exit_code_result(0);
+    }
+
+    int exit_code = 0;
+    for (size_t i = 1; i < command->words_count; ++i) {
+        char* word = command->words[i];
+        if (strcmp(word, "-r") == 0) {
+            clear_path_table(table);
+        } else if (strcmp(word, "-s") == 0) {
+            check_path_variable(table);
+            write_output_format(output, "hits %zu, misses %zu, entries %zu\n",
+                                table->hits, table->misses,
+                                table->entries_count);
+        } else if (word[0] == '-') {
+            fprintf(stderr, "sush: hash: %s: invalid option\n", word);
+            return exit_code_result(2);
+        } else if (strchr(word, '/') == NULL &&
+                   add_command_path(table, word) == NULL) {
+            fprintf(stderr, "sush: hash: %s: not found\n", word);
+            exit_code = 1;
+        }
+    }
+
+    return exit_code_result(exit_code);
+}
+
+struct builtin builtins[] = {
+    {.name = "cd", .function = execute_cd, .is_pure = false},
+    {.name = "exit", .function = execute_exit, .is_pure = false},
+    {.name = "export", .function = execute_export, .is_pure = false},
+    {.name = "echo", .function = execute_echo, .is_pure = true},
+    {.name = "true", .function = execute_true, .is_pure = true},
+    {.name = "false", .function = execute_false, .is_pure = true},
+    {.name = "test", .function = execute_test, .is_pure = true},
+    {.name = "[", .function = execute_test, .is_pure = true},
+    {.name = "printf", .function = execute_printf, .is_pure = true},
+    {.name = "pwd", .function = execute_pwd, .is_pure = true},
+    {.name = "hash", .function = execute_hash, .is_pure = false},
+};
+
+// Open addressing with linear probing. The table is 4 times bigger than
+// the number of the builtins, so a lookup is a hash and one strcmp(),
+// and a command which is not a builtin usually stops at an empty slot.
+#define BUILTINS_TABLE_SIZE 64
+
+struct builtin* builtins_table[BUILTINS_TABLE_SIZE];
+bool is_builtins_table_built = false;
+
+void build_builtins_table(void) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); ++i) {
+        uint32_t slot = hash_string(builtins[i].name) % BUILTINS_TABLE_SIZE;
+        while (builtins_table[slot] != NULL) {
+            slot = (slot + 1) % BUILTINS_TABLE_SIZE;
+        }
+        builtins_table[slot] = &builtins[i];
+    }
+    is_builtins_table_built = true;
+}
+
+const struct builtin* find_builtin(char* name) {
+    if (!is_builtins_table_built) {
+        build_builtins_table();
+    }
+
+    uint32_t slot = hash_string(name) % BUILTINS_TABLE_SIZE;
+    while (builtins_table[slot] != NULL) {
+        if (strcmp(builtins_table[slot]->name, name) == 0) {
+            return builtins_table[slot];
+        }
+        slot = (slot + 1) % BUILTINS_TABLE_SIZE;
+    }
+    return NULL;
+}
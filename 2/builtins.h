@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "command.h"
+
+// The output of a builtin is collected first, and then the shell writes
+// it where it should go: to a file, a pipe or stdout.
+struct builtin_output {
+    char* buffer;
+    size_t length;
+    size_t capacity;
+};
+
+typedef struct execution_result (*builtin_function)(
+    struct simple_command* command, struct execution_context* context,
+    struct builtin_output* output);
+
+struct builtin {
+    char* name;
+    builtin_function function;
+    // It doesn't change the state of the shell, so it can run in the
+    // shell process even inside a pipeline, where it is a subshell.
+    bool is_pure;
+};
+
+// Finds the builtin by the command name. Returns NULL if there is none.
+const struct builtin* find_builtin(char* name);
+
+void init_builtin_output(struct builtin_output* output);
+void free_builtin_output(struct builtin_output* output);
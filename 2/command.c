@@ -1,4 +1,9 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,100 +12,145 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "builtins.h"
 #include "command.h"
 
+extern char** environ;
+
 struct pipes {
     bool should_pipe_input;
     bool should_pipe_output;
     int input_fd;
     int output_fd;
+    // the other end of the output pipe, a forked child closes it
+    int output_read_fd;
 };
 
-enum builtin_result {
-    NOT_BUILTIN,
-    BUILTIN_EXECUTED,
-    BUILTIN_EXIT,
-};
-
-void execute_cd(struct simple_command* command, int* exit_code) {
-    if (command->words_count > 2) {
-        fprintf(stderr, "sush: cd: too many arguments\n");
-        *exit_code = 1;
+// Writes the whole buffer, a pipe can take it in parts.
+bool write_all(int fd, char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return false;
+        }
+        buffer += written;
+        length -= (size_t)written;
     }
+    return true;
+}
 
-    char* new_cwd = NULL;
-    if (command->words_count == 1) {
-        new_cwd = getenv("HOME");
-    } else {
-        new_cwd = command->words[1];
-    }
-    if (new_cwd == NULL) {
-        *exit_code = 0;
-        return;
+void write_builtin_output(int fd, struct builtin_output* output,
+                          struct execution_result* result) {
+    if (!write_all(fd, output->buffer, output->length)) {
+        perror("sush: write error");
+        result->exit_code = 1;
     }
+}
 
-    if (chdir(new_cwd) < 0) {
-        perror("sush: cd");
-        *exit_code = 1;
-        return;
+// Whether a write of this size to a new pipe doesn't block. The reader of
+// the pipe is started later, so a bigger write would block forever.
+bool fits_pipe(int fd, size_t length) {
+    int capacity = fcntl(fd, F_GETPIPE_SZ);
+    if (capacity < 0) {
+        capacity = PIPE_BUF;
     }
-
-    *exit_code = 0;
+    return length <= (size_t)capacity;
 }
 
-enum builtin_result execute_exit(struct simple_command* command,
-                                 struct execution_context* context,
-                                 int* exit_code) {
-    if (command->words_count > 2) {
-        fprintf(stderr, "sush: exit: too many arguments\n");
-        *exit_code = 1;
-        return BUILTIN_EXECUTED;
+// Runs a builtin in the shell process. The redirect files are opened as
+// for an external command, and the output is written to the output
+// file, the pipe or stdout. Returns the pid of a child which writes the
+// output if it doesn't fit the pipe, otherwise -1.
+pid_t run_builtin(const struct builtin* builtin,
+                  struct simple_command* command,
+                  struct execution_context* context, struct pipes* pipes,
+                  struct execution_result* result) {
+    result->exit_code = 127;
+    result->should_terminate = false;
+    if (command->input_file != NULL) {
+        // builtins don't read the input, but the file must exist
+        int fd = open(command->input_file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("sush: failed to redirect input");
+            return -1;
+        }
+        close(fd);
     }
 
-    if (command->words_count == 2) {
-        int length;
-        int result = sscanf(command->words[1], "%d%n", exit_code, &length);
-        if (result < 1 || (size_t)length < strlen(command->words[1])) {
-            fprintf(stderr, "sush: exit: invalid number: %s\n",
-                    command->words[1]);
+    int output_fd = 1;
+    bool is_pipe = false;
+    if (command->output_file != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        if (command->output_mode == OUTPUT_APPEND) {
+            flags |= O_APPEND;
+        } else {
+            flags |= O_TRUNC;
+        }
 
-            *exit_code = 1;
-            return BUILTIN_EXECUTED;
+        output_fd = open(command->output_file, flags, 0664);
+        if (output_fd < 0) {
+            perror("sush: failed to redirect output");
+            return -1;
         }
-    } else {
-        *exit_code = context->last_exit_code;
+    } else if (pipes->should_pipe_output) {
+        output_fd = pipes->output_fd;
+        is_pipe = true;
     }
 
-    return BUILTIN_EXIT;
-}
+    struct builtin_output output;
+    init_builtin_output(&output);
+    *result = builtin->function(command, context, &output);
 
-enum builtin_result execute_builtin_command(struct simple_command* command,
-                                            struct execution_context* context,
-                                            int* exit_code) {
-    if (strcmp(command->words[0], "cd") == 0) {
-        execute_cd(command, exit_code);
-        return BUILTIN_EXECUTED;
+    pid_t child = -1;
+    if (is_pipe && !fits_pipe(output_fd, output.length)) {
+        child = fork();
+        if (child < 0) {
+            perror("sush: failed to fork");
+            exit(127);
+        }
+        if (child == 0) {
+            // the pipe ends, which keep the reader and the writer waiting
+            close(pipes->output_read_fd);
+            if (pipes->should_pipe_input) {
+                close(pipes->input_fd);
+            }
+            write_builtin_output(output_fd, &output, result);
+            _exit(result->exit_code);
+        }
+    } else {
+        write_builtin_output(output_fd, &output, result);
     }
 
-    if (strcmp(command->words[0], "exit") == 0) {
-        return execute_exit(command, context, exit_code);
+    if (command->output_file != NULL) {
+        close(output_fd);
     }
+    free_builtin_output(&output);
+    return child;
+}
 
-    return NOT_BUILTIN;
+// The arguments to run a file without '#!' as a script of /bin/sh, like
+// execvp() does: "/bin/sh", the path and the arguments of the command.
+char** make_script_words(struct simple_command* command, char* path) {
+    char** words = malloc((command->words_count + 2) * sizeof(char*));
+    if (words == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+    words[0] = "/bin/sh";
+    words[1] = path;
+    // with the NULL at the end
+    memcpy(words + 2, command->words + 1,
+           command->words_count * sizeof(char*));
+    return words;
 }
 
+// Runs the command in a forked child.
 int execute_simple_command(struct simple_command* command,
                            struct execution_context* context,
                            struct pipes* pipes) {
-    int exit_code;
-    switch (execute_builtin_command(command, context, &exit_code)) {
-    case NOT_BUILTIN:
-        break;
-    case BUILTIN_EXIT:
-    case BUILTIN_EXECUTED:
-        return exit_code;
-    }
-
     if (command->input_file != NULL) {
         int fd = open(command->input_file, O_RDONLY);
         if (fd < 0 || dup2(fd, 0) < 0 || close(fd) < 0) {
@@ -138,38 +188,160 @@ int execute_simple_command(struct simple_command* command,
         }
     }
 
-    execvp(command->words[0], command->words);
+    if (command->words_count == 0) {
+        return 0;
+    }
+
+    const struct builtin* builtin = find_builtin(command->words[0]);
+    if (builtin != NULL) {
+        struct builtin_output output;
+        init_builtin_output(&output);
+        struct execution_result result =
+            builtin->function(command, context, &output);
+        write_builtin_output(1, &output, &result);
+        return result.exit_code;
+    }
+
+    char* path = command->words[0];
+    if (strchr(path, '/') == NULL) {
+        path = find_command_path(&context->path_table, path);
+    }
+    if (path == NULL) {
+        errno = ENOENT;
+    } else {
+        execve(path, command->words, environ);
+        if (errno == ENOEXEC) {
+            execve("/bin/sh", make_script_words(command, path), environ);
+        }
+    }
     perror("sush: failed to execute command");
     return 127;
 }
 
-void free_simple_command(struct simple_command* command) {
-    free(command->input_file);
-    command->input_file = NULL;
+// posix_spawn() with the same fallback to /bin/sh as in execvp(), which
+// posix_spawn() doesn't do.
+int spawn_command(pid_t* child, char* path, posix_spawn_file_actions_t* actions,
+                  struct simple_command* command) {
+    int error = posix_spawn(child, path, actions, NULL, command->words,
+                            environ);
+    if (error != ENOEXEC) {
+        return error;
+    }
+
+    char** words = make_script_words(command, path);
+    error = posix_spawn(child, "/bin/sh", actions, NULL, words, environ);
+    free(words);
+    return error;
+}
+
+// Starts an external command with posix_spawn(), which does not copy the
+// page tables of the shell like fork() does. The redirect files are
+// opened here, so as the errors are the same as in the forked child, and
+// the child only dup2()s them. Returns -1 if no child is started, then
+// the exit code is set.
+pid_t spawn_simple_command(struct simple_command* command,
+                           struct execution_context* context,
+                           struct pipes* pipes, int* exit_code) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+
+    pid_t child = -1;
+    *exit_code = 127;
+    int input_fd = -1;
+    int output_fd = -1;
+    if (command->input_file != NULL) {
+        input_fd = open(command->input_file, O_RDONLY | O_CLOEXEC);
+        if (input_fd < 0) {
+            perror("sush: failed to redirect input");
+            goto end;
+        }
+        posix_spawn_file_actions_adddup2(&actions, input_fd, 0);
+    }
+
+    if (pipes->should_pipe_input) {
+        posix_spawn_file_actions_adddup2(&actions, pipes->input_fd, 0);
+    }
+
+    if (command->output_file != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        if (command->output_mode == OUTPUT_APPEND) {
+            flags |= O_APPEND;
+        } else {
+            flags |= O_TRUNC;
+        }
+
+        output_fd = open(command->output_file, flags, 0664);
+        if (output_fd < 0) {
+            perror("sush: failed to redirect output");
+            goto end;
+        }
+        posix_spawn_file_actions_adddup2(&actions, output_fd, 1);
+    }
 
-    free(command->output_file);
-    command->output_file = NULL;
+    if (pipes->should_pipe_output) {
+        posix_spawn_file_actions_adddup2(&actions, pipes->output_fd, 1);
+    }
 
-    for (size_t i = 0; i < command->words_count; ++i) {
-        free(command->words[i]);
+    if (command->words_count == 0) {
+        // only the redirects, like '> file'
+        *exit_code = 0;
+        goto end;
     }
-    command->words_count = 0;
 
-    free(command->words);
-    command->words = NULL;
+    // The exec errors are reported by posix_spawn() itself. A path from
+    // the table may be stale, then PATH is searched again.
+    char* name = command->words[0];
+    bool is_in_path = strchr(name, '/') == NULL;
+    struct path_table* table = &context->path_table;
+    size_t hits = table->hits;
+    int error = ENOENT;
+    char* path = name;
+    if (is_in_path) {
+        path = find_command_path(table, name);
+    }
+    if (path != NULL) {
+        error = spawn_command(&child, path, &actions, command);
+    }
+    if (error != 0 && is_in_path && table->hits != hits) {
+        path = add_command_path(table, name);
+        error = ENOENT;
+        if (path != NULL) {
+            error = spawn_command(&child, path, &actions, command);
+        }
+    }
+    if (error != 0) {
+        if (is_in_path) {
+            forget_command_path(table, name);
+        }
+        fprintf(stderr, "sush: failed to execute command: %s\n",
+                strerror(error));
+        child = -1;
+    }
+
+end:
+    if (input_fd >= 0) {
+        close(input_fd);
+    }
+    if (output_fd >= 0) {
+        close(output_fd);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return child;
 }
 
 struct execution_result execute_pipeline(struct pipeline* pipeline,
                                          struct execution_context* context) {
-    if (pipeline->commands_count == 1) {
-        int exit_code;
-        enum builtin_result builtin_result = execute_builtin_command(
-            &pipeline->commands[0], context, &exit_code);
-
-        if (builtin_result != NOT_BUILTIN) {
-            struct execution_result result = {
-                .exit_code = exit_code,
-                .should_terminate = builtin_result == BUILTIN_EXIT};
+    struct simple_command* first = &pipeline->commands[0];
+    if (pipeline->commands_count == 1 && first->words_count > 0) {
+        const struct builtin* builtin = find_builtin(first->words[0]);
+        if (builtin != NULL) {
+            struct pipes no_pipes = {.should_pipe_input = false,
+                                     .should_pipe_output = false};
+            struct execution_result result;
+            run_builtin(builtin, first, context, &no_pipes, &result);
             return result;
         }
     }
@@ -181,6 +353,8 @@ struct execution_result execute_pipeline(struct pipeline* pipeline,
     }
 
     int previous_read_end;
+    // of the last command, if it is not started
+    int exit_code = 0;
     for (size_t i = 0; i < pipeline->commands_count; ++i) {
         struct pipes this_pipes = {
             .should_pipe_input = i > 0,
@@ -192,26 +366,54 @@ struct execution_result execute_pipeline(struct pipeline* pipeline,
 
         int next_read_end;
         if (this_pipes.should_pipe_output) {
+            // the ends are not inherited by the children, they get dup2()
+            // copies
             int pipe_fds[2];
-            if (pipe(pipe_fds) < 0) {
+            if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
                 perror("Failed to create a pipe");
                 exit(127);
             }
             next_read_end = pipe_fds[0];
             this_pipes.output_fd = pipe_fds[1];
+            this_pipes.output_read_fd = next_read_end;
         }
 
-        pid_t child = fork();
-        if (child < 0) {
-            perror("sush: failed to fork");
-            exit(127);
+        // Builtins run in a subshell inside a pipeline. The pure ones
+        // don't change the shell, so they run here, and only the others
+        // need a fork. Define FORK_ONLY to fork for everything, like
+        // before.
+        struct simple_command* command = &pipeline->commands[i];
+        const struct builtin* builtin = NULL;
+        if (command->words_count > 0) {
+            builtin = find_builtin(command->words[0]);
         }
-        if (child == 0) {
-            if (this_pipes.should_pipe_output) {
-                close(next_read_end);
+        bool should_fork = builtin != NULL && !builtin->is_pure;
+        bool should_run_here = builtin != NULL && builtin->is_pure;
+#ifdef FORK_ONLY
+        should_fork = true;
+        should_run_here = false;
+#endif
+        pid_t child;
+        if (should_run_here) {
+            struct execution_result result;
+            child = run_builtin(builtin, command, context, &this_pipes,
+                                &result);
+            exit_code = result.exit_code;
+        } else if (should_fork) {
+            child = fork();
+            if (child < 0) {
+                perror("sush: failed to fork");
+                exit(127);
             }
-            _exit(execute_simple_command(&pipeline->commands[i], context,
-                                         &this_pipes));
+            if (child == 0) {
+                if (this_pipes.should_pipe_output) {
+                    close(next_read_end);
+                }
+                _exit(execute_simple_command(command, context, &this_pipes));
+            }
+        } else {
+            child = spawn_simple_command(command, context, &this_pipes,
+                                         &exit_code);
         }
 
         children[i] = child;
@@ -224,8 +426,11 @@ struct execution_result execute_pipeline(struct pipeline* pipeline,
         }
     }
 
-    int exit_code;
     for (size_t i = 0; i < pipeline->commands_count; ++i) {
+        if (children[i] < 0) {
+            continue;
+        }
+
         int status;
         waitpid(children[i], &status, 0);
         if (i < pipeline->commands_count - 1) {
@@ -246,16 +451,6 @@ struct execution_result execute_pipeline(struct pipeline* pipeline,
     return result;
 }
 
-void free_pipeline(struct pipeline* pipeline) {
-    for (size_t i = 0; i < pipeline->commands_count; ++i) {
-        free_simple_command(&pipeline->commands[i]);
-    }
-    pipeline->commands_count = 0;
-
-    free(pipeline->commands);
-    pipeline->commands = NULL;
-}
-
 struct execution_result
 execute_boolean_command(struct boolean_command* command,
                         struct execution_context* context) {
@@ -278,15 +473,6 @@ execute_boolean_command(struct boolean_command* command,
     return result;
 }
 
-void free_boolean_command(struct boolean_command* command) {
-    if (command->next != NULL) {
-        free_boolean_command(command->next);
-        free(command->next);
-        command->next = NULL;
-    }
-    free_pipeline(&command->pipeline);
-}
-
 struct execution_result execute_job_command(struct job_command* job,
                                             struct execution_context* context) {
     struct execution_result result;
@@ -326,12 +512,3 @@ struct execution_result execute_job_command(struct job_command* job,
 
     return execute_job_command(job->next, context);
 }
-
-void free_job_command(struct job_command* job) {
-    if (job->next != NULL) {
-        free_job_command(job->next);
-        free(job->next);
-        job->next = NULL;
-    }
-    free_boolean_command(&job->command);
-}
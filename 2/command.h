@@ -2,6 +2,8 @@
 
 #include <stdlib.h>
 
+#include "path_table.h"
+
 struct simple_command {
     char** words;
     size_t words_count;
@@ -13,15 +15,11 @@ struct simple_command {
     } output_mode;
 };
 
-void free_simple_command(struct simple_command* command);
-
 struct pipeline {
     struct simple_command* commands;
     size_t commands_count;
 };
 
-void free_pipeline(struct pipeline* pipeline);
-
 struct boolean_command {
     struct pipeline pipeline;
     enum {
@@ -31,8 +29,6 @@ struct boolean_command {
     struct boolean_command* next;
 };
 
-void free_boolean_command(struct boolean_command* command);
-
 struct job_command {
     struct boolean_command command;
     enum {
@@ -46,6 +42,7 @@ struct execution_context {
     int last_exit_code;
     pid_t* jobs;
     size_t jobs_count;
+    struct path_table path_table;
 };
 
 struct execution_result {
@@ -54,4 +51,3 @@ struct execution_result {
 };
 
 struct execution_result execute_job_command(struct job_command* job, struct execution_context* context);
-void free_job_command(struct job_command* job);
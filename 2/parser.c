@@ -3,33 +3,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "arena.h"
 #include "command.h"
 #include "parser.h"
 
-void ensure_string(char** string) {
-    if (*string != NULL) {
-        return;
-    }
-
-    *string = malloc(sizeof(char));
-    if (*string == NULL) {
-        perror("Failed to allocate a string");
-        exit(127);
-    }
-    (*string)[0] = '\0';
-}
-
-void push_character(char** string, size_t* size, char character) {
-    *string = realloc(*string, sizeof(char) * (*size + 2));
-    if (*string == NULL) {
-        perror("Failed to allocate a string");
-        exit(127);
-    }
-    (*string)[*size] = character;
-    (*string)[*size + 1] = '\0';
-    ++*size;
-}
-
 char peek_character(char** input) { return **input; }
 void advance(char** input) { ++*input; }
 
@@ -79,24 +56,54 @@ struct token {
     char* word;
 };
 
-enum parsing_result parse_word(char** input, char** word) {
-    size_t word_size = 0;
-    *word = NULL;
+enum escaping {
+    ESCAPING_NONE,
+    ESCAPING_BACKSLASH,
+    ESCAPING_SINGLE_QUOTE,
+    ESCAPING_DOUBLE_QUOTE,
+    ESCAPING_DOUBLE_QUOTE_BACKSLASH,
+};
 
-    enum {
-        ESCAPING_NONE,
-        ESCAPING_BACKSLASH,
-        ESCAPING_SINGLE_QUOTE,
-        ESCAPING_DOUBLE_QUOTE,
-        ESCAPING_DOUBLE_QUOTE_BACKSLASH,
-    } escaping = ESCAPING_NONE;
+struct lexer {
+    char* input;
+    // The words are written one after another into a buffer of at least
+    // the input size. A word never has more characters than its source
+    // text, and the zero after it takes the place of the delimiter.
+    char* words_end;
+    // the state of a word to continue, see struct parser
+    char* word_start;
+    enum escaping word_escaping;
+    bool is_word_quoted;
+    struct arena* arena;
+    // all the lexed tokens, the parser reads them one by one
+    struct token* tokens;
+    size_t tokens_count;
+    size_t position;
+    // what the lexer has stopped at, after the tokens
+    enum parsing_result end_result;
+};
+
+enum parsing_result parse_word(struct lexer* lexer, char** word) {
+    char** input = &lexer->input;
+    char* word_start = lexer->words_end;
+    // '' and "" are empty words, not the absence of a word
+    bool is_quoted = false;
+    enum escaping escaping = ESCAPING_NONE;
+    if (lexer->word_start != NULL) {
+        word_start = lexer->word_start;
+        is_quoted = lexer->is_word_quoted;
+        escaping = lexer->word_escaping;
+        lexer->word_start = NULL;
+    }
+    char* word_end = lexer->words_end;
+    *word = NULL;
 
     char character;
     while ((character = peek_character(input)) != '\0') {
         switch (escaping) {
         case ESCAPING_BACKSLASH:
             if (character != '\n') {
-                push_character(word, &word_size, character);
+                *word_end++ = character;
             }
             escaping = ESCAPING_NONE;
             break;
@@ -105,15 +112,15 @@ enum parsing_result parse_word(char** input, char** word) {
             if (character == '\'') {
                 escaping = ESCAPING_NONE;
             } else {
-                push_character(word, &word_size, character);
+                *word_end++ = character;
             }
             break;
 
         case ESCAPING_DOUBLE_QUOTE_BACKSLASH:
             if (character != '"' && character != '\\' && character != '\n') {
-                push_character(word, &word_size, '\\');
+                *word_end++ = '\\';
             }
-            push_character(word, &word_size, character);
+            *word_end++ = character;
             escaping = ESCAPING_DOUBLE_QUOTE;
             break;
 
@@ -125,7 +132,7 @@ enum parsing_result parse_word(char** input, char** word) {
             } else if (character == '"') {
                 escaping = ESCAPING_NONE;
             } else {
-                push_character(word, &word_size, character);
+                *word_end++ = character;
             }
             break;
 
@@ -135,11 +142,11 @@ enum parsing_result parse_word(char** input, char** word) {
                 escaping = ESCAPING_BACKSLASH;
                 break;
             case '\'':
-                ensure_string(word);
+                is_quoted = true;
                 escaping = ESCAPING_SINGLE_QUOTE;
                 break;
             case '"':
-                ensure_string(word);
+                is_quoted = true;
                 escaping = ESCAPING_DOUBLE_QUOTE;
                 break;
             case '>':
@@ -154,7 +161,7 @@ enum parsing_result parse_word(char** input, char** word) {
                 if (is_line_whitespace(character)) {
                     goto end;
                 }
-                push_character(word, &word_size, character);
+                *word_end++ = character;
             }
         }
 
@@ -163,13 +170,20 @@ enum parsing_result parse_word(char** input, char** word) {
 
 end:
     if (escaping == ESCAPING_NONE) {
+        if (word_end > word_start || is_quoted) {
+            *word_end++ = '\0';
+            *word = word_start;
+            lexer->words_end = word_end;
+        }
         return PARSING_SUCCESS;
     }
 
-    free(*word);
-    *word = NULL;
-
     if (character == '\0') {
+        // more input may continue the word
+        lexer->word_start = word_start;
+        lexer->word_escaping = escaping;
+        lexer->is_word_quoted = is_quoted;
+        lexer->words_end = word_end;
         return PARSING_INCOMPLETE_INPUT;
     }
 
@@ -185,13 +199,18 @@ void skip_token(char** input, char* token) {
     skip_whitespace(input);
 }
 
-enum parsing_result parse_token(char** input, struct token* token) {
+enum parsing_result parse_token(struct lexer* lexer, struct token* token) {
+    char** input = &lexer->input;
+    if (lexer->word_start != NULL) {
+        goto word;
+    }
+
     switch (peek_character(input)) {
     case '\0':
         return PARSING_EMPTY;
     case '#':
         skip_comment(input);
-        return parse_token(input, token);
+        return parse_token(lexer, token);
     }
 
     if (is_token(*input, "<")) {
@@ -222,7 +241,8 @@ enum parsing_result parse_token(char** input, struct token* token) {
         token->tag = TOKEN_NEWLINE;
         skip_token(input, "\n");
     } else {
-        enum parsing_result result = parse_word(input, &token->word);
+    word:;
+        enum parsing_result result = parse_word(lexer, &token->word);
         if (result != PARSING_SUCCESS) {
             return result;
         }
@@ -235,27 +255,112 @@ enum parsing_result parse_token(char** input, struct token* token) {
     return PARSING_SUCCESS;
 }
 
-struct lexer {
-    char* input;
-    bool is_holding_token;
+void push_token(struct parser* parser, struct token* token) {
+    if (parser->tokens_count == parser->tokens_capacity) {
+        parser->tokens_capacity =
+            parser->tokens_capacity == 0 ? 64 : parser->tokens_capacity * 2;
+        parser->tokens = realloc(parser->tokens, sizeof(struct token) *
+                                                     parser->tokens_capacity);
+        if (parser->tokens == NULL) {
+            perror("Failed to allocate memory");
+            exit(127);
+        }
+    }
+    parser->tokens[parser->tokens_count] = *token;
+    ++parser->tokens_count;
+}
+
+void keep_words(struct parser* parser, struct lexer* lexer, char* input) {
+    parser->words_left -= lexer->words_end - parser->words_end;
+    parser->words_end = lexer->words_end;
+    parser->input_offset = lexer->input - input;
+}
+
+// Makes room for the words of the input after the kept tokens. The
+// buffer grows by doubling, the cut word is moved to the new one.
+void reserve_words(struct parser* parser, size_t input_length) {
+    size_t word_length = 0;
+    if (parser->word_start != NULL) {
+        word_length = parser->words_end - parser->word_start;
+    }
+    if (input_length + 1 <= parser->words_left) {
+        return;
+    }
+
+    size_t capacity = parser->words_capacity * 2;
+    if (capacity < word_length + input_length + 1) {
+        capacity = word_length + input_length + 1;
+    }
+    char* words = arena_alloc(&parser->arena, capacity);
+    if (parser->word_start != NULL) {
+        memcpy(words, parser->word_start, word_length);
+        parser->word_start = words;
+    }
+    parser->words_end = words + word_length;
+    parser->words_left = capacity - word_length;
+    parser->words_capacity = capacity;
+}
+
+// Lexes the input after the tokens of the previous calls. A token is
+// kept for the next call only if more input can't change it: it is not
+// at the very end, like a word which can continue after an escaped
+// newline. Otherwise it is lexed again. A word cut inside quotes is
+// kept as it is, and the lexer continues it.
+enum parsing_result lex_input(struct parser* parser, struct lexer* lexer,
+                              char* input) {
+    lexer->input = input + parser->input_offset;
+    reserve_words(parser, strlen(lexer->input));
+    lexer->words_end = parser->words_end;
+    lexer->word_start = parser->word_start;
+    lexer->word_escaping = parser->word_escaping;
+    lexer->is_word_quoted = parser->is_word_quoted;
+    parser->word_start = NULL;
+    size_t kept_count = parser->tokens_count;
+    bool is_keeping = true;
+
+    enum parsing_result result;
     struct token token;
-    enum parsing_result token_result;
-};
+    while ((result = parse_token(lexer, &token)) == PARSING_SUCCESS) {
+        push_token(parser, &token);
+        is_keeping = is_keeping &&
+                     (token.tag == TOKEN_NEWLINE || *lexer->input != '\0');
+        if (is_keeping) {
+            kept_count = parser->tokens_count;
+            keep_words(parser, lexer, input);
+        }
+    }
+
+    if (result == PARSING_INCOMPLETE_INPUT && lexer->word_start != NULL &&
+        is_keeping) {
+        keep_words(parser, lexer, input);
+        parser->word_start = lexer->word_start;
+        parser->word_escaping = lexer->word_escaping;
+        parser->is_word_quoted = lexer->is_word_quoted;
+    }
+
+    lexer->tokens = parser->tokens;
+    lexer->tokens_count = parser->tokens_count;
+    lexer->position = 0;
+    lexer->end_result = result;
+    parser->tokens_count = kept_count;
+    return result;
+}
 
 enum parsing_result peek_token(struct lexer* lexer, struct token* token) {
-    if (!lexer->is_holding_token) {
-        lexer->token_result = parse_token(&lexer->input, &lexer->token);
-        lexer->is_holding_token = true;
+    if (lexer->position == lexer->tokens_count) {
+        // written anyway, so as the compiler sees it initialized
+        token->tag = TOKEN_NEWLINE;
+        token->word = NULL;
+        return lexer->end_result;
     }
-    *token = lexer->token;
-    return lexer->token_result;
+    *token = lexer->tokens[lexer->position];
+    return PARSING_SUCCESS;
 }
 
 void advance_lexer(struct lexer* lexer) {
-    if (!lexer->is_holding_token) {
-        lexer->token_result = parse_token(&lexer->input, &lexer->token);
+    if (lexer->position < lexer->tokens_count) {
+        ++lexer->position;
     }
-    lexer->is_holding_token = false;
 }
 
 enum parsing_result skip_newlines(struct lexer* lexer) {
@@ -274,6 +379,7 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
     command->words_count = 0;
     command->input_file = NULL;
     command->output_file = NULL;
+    size_t words_capacity = 0;
 
     struct token token;
     enum parsing_result result;
@@ -284,7 +390,7 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
             result = PARSING_INCOMPLETE_INPUT;
         }
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
 
         switch (token.tag) {
@@ -292,11 +398,12 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
             if (token.word == NULL) {
                 break;
             }
-            command->words = realloc(
-                command->words, sizeof(char*) * (command->words_count + 2));
-            if (command->words == NULL) {
-                perror("Failed to allocate memory");
-                exit(127);
+            if (command->words_count + 2 > words_capacity) {
+                size_t capacity = words_capacity == 0 ? 8 : words_capacity * 2;
+                command->words = arena_realloc(
+                    lexer->arena, command->words,
+                    sizeof(char*) * words_capacity, sizeof(char*) * capacity);
+                words_capacity = capacity;
             }
             command->words[command->words_count] = token.word;
             command->words[command->words_count + 1] = NULL;
@@ -307,14 +414,12 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
             advance_lexer(lexer);
             result = peek_token(lexer, &token);
             if (result != PARSING_SUCCESS) {
-                goto fail;
+                return result;
             }
             if (token.tag != TOKEN_WORD) {
-                result = PARSING_SYNTAX_ERROR;
-                goto fail;
+                return PARSING_SYNTAX_ERROR;
             }
 
-            free(command->input_file);
             command->input_file = token.word;
             break;
 
@@ -322,14 +427,12 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
             advance_lexer(lexer);
             result = peek_token(lexer, &token);
             if (result != PARSING_SUCCESS) {
-                goto fail;
+                return result;
             }
             if (token.tag != TOKEN_WORD) {
-                result = PARSING_SYNTAX_ERROR;
-                goto fail;
+                return PARSING_SYNTAX_ERROR;
             }
 
-            free(command->output_file);
             command->output_file = token.word;
             command->output_mode = OUTPUT_OVERWRITE;
             break;
@@ -338,14 +441,12 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
             advance_lexer(lexer);
             result = peek_token(lexer, &token);
             if (result != PARSING_SUCCESS) {
-                goto fail;
+                return result;
             }
             if (token.tag != TOKEN_WORD) {
-                result = PARSING_SYNTAX_ERROR;
-                goto fail;
+                return PARSING_SYNTAX_ERROR;
             }
 
-            free(command->output_file);
             command->output_file = token.word;
             command->output_mode = OUTPUT_APPEND;
             break;
@@ -360,20 +461,16 @@ enum parsing_result parse_simple_command(struct lexer* lexer,
 
 end:
     if (!has_parsed_anything) {
-        result = PARSING_SYNTAX_ERROR;
-        goto fail;
+        return PARSING_SYNTAX_ERROR;
     }
     return result;
-
-fail:
-    free_simple_command(command);
-    return result;
 }
 
 enum parsing_result parse_pipeline(struct lexer* lexer,
                                    struct pipeline* pipeline) {
     pipeline->commands = NULL;
     pipeline->commands_count = 0;
+    size_t commands_capacity = 0;
 
     enum parsing_result result;
     while (true) {
@@ -383,15 +480,17 @@ enum parsing_result parse_pipeline(struct lexer* lexer,
             result = PARSING_INCOMPLETE_INPUT;
         }
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
 
-        pipeline->commands =
-            realloc(pipeline->commands, sizeof(struct simple_command) *
-                                            (pipeline->commands_count + 1));
-        if (pipeline->commands == NULL) {
-            perror("Failed to allocate memory");
-            exit(127);
+        if (pipeline->commands_count == commands_capacity) {
+            size_t capacity =
+                commands_capacity == 0 ? 4 : commands_capacity * 2;
+            pipeline->commands = arena_realloc(
+                lexer->arena, pipeline->commands,
+                sizeof(struct simple_command) * commands_capacity,
+                sizeof(struct simple_command) * capacity);
+            commands_capacity = capacity;
         }
         pipeline->commands[pipeline->commands_count] = command;
         ++pipeline->commands_count;
@@ -399,7 +498,7 @@ enum parsing_result parse_pipeline(struct lexer* lexer,
         struct token token;
         result = peek_token(lexer, &token);
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
         if (token.tag == TOKEN_PIPE) {
             advance_lexer(lexer);
@@ -411,9 +510,6 @@ enum parsing_result parse_pipeline(struct lexer* lexer,
     }
 
     return PARSING_SUCCESS;
-fail:
-    free_pipeline(pipeline);
-    return result;
 }
 
 enum parsing_result parse_boolean_command(struct lexer* lexer,
@@ -424,13 +520,13 @@ enum parsing_result parse_boolean_command(struct lexer* lexer,
     while (true) {
         result = parse_pipeline(lexer, &command->pipeline);
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
 
         struct token token;
         result = peek_token(lexer, &token);
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
         switch (token.tag) {
         case TOKEN_OR:
@@ -446,27 +542,20 @@ enum parsing_result parse_boolean_command(struct lexer* lexer,
         advance_lexer(lexer);
         skip_newlines(lexer);
 
-        command->next = malloc(sizeof(struct boolean_command));
-        if (command->next == NULL) {
-            perror("Failed to allocate memory");
-            exit(127);
-        }
+        command->next =
+            arena_alloc(lexer->arena, sizeof(struct boolean_command));
         result = parse_boolean_command(lexer, command->next);
         if (result == PARSING_EMPTY) {
             result = PARSING_INCOMPLETE_INPUT;
         }
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
         break;
     }
 
 end:
     return PARSING_SUCCESS;
-
-fail:
-    free_boolean_command(command);
-    return result;
 }
 
 enum parsing_result parse_job_command(struct lexer* lexer,
@@ -477,13 +566,13 @@ enum parsing_result parse_job_command(struct lexer* lexer,
     while (true) {
         result = parse_boolean_command(lexer, &job->command);
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
 
         struct token token;
         result = peek_token(lexer, &token);
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
         switch (token.tag) {
         case TOKEN_BACKGROUND:
@@ -508,31 +597,139 @@ enum parsing_result parse_job_command(struct lexer* lexer,
             goto end;
         case PARSING_INCOMPLETE_INPUT:
         case PARSING_SYNTAX_ERROR:
-            goto fail;
+            return result;
         }
 
-        job->next = malloc(sizeof(struct job_command));
-        if (job->next == NULL) {
-            perror("Failed to allocate memory");
-            exit(127);
-        }
+        job->next = arena_alloc(lexer->arena, sizeof(struct job_command));
         result = parse_job_command(lexer, job->next);
         if (result != PARSING_SUCCESS) {
-            goto fail;
+            return result;
         }
         break;
     }
 
 end:
     return PARSING_SUCCESS;
+}
 
-fail:
-    free_job_command(job);
-    return result;
+// The grammar of parse_job_command() as a state machine over the tokens.
+// It tells whether the input is complete, so as the command tree is
+// built only once, at the end of a command of many lines. The state of
+// the kept tokens is saved, and each of them is checked only once.
+enum check_state {
+    // the start of a job, newlines are skipped
+    CHECK_JOB_START,
+    // after '|', '&&' or '||', newlines are skipped
+    CHECK_OPERATOR,
+    // in a simple command
+    CHECK_COMMAND,
+    // after a redirect, its file is expected
+    CHECK_REDIRECT,
+    CHECK_SYNTAX_ERROR,
+};
+
+enum check_state check_token(enum check_state state, struct token* token) {
+    if (state == CHECK_SYNTAX_ERROR) {
+        return state;
+    }
+    if (state == CHECK_REDIRECT) {
+        return token->tag == TOKEN_WORD ? CHECK_COMMAND : CHECK_SYNTAX_ERROR;
+    }
+
+    switch (token->tag) {
+    case TOKEN_WORD:
+        return CHECK_COMMAND;
+    case TOKEN_REDIRECT_INPUT:
+    case TOKEN_REDIRECT_OUTPUT:
+    case TOKEN_APPEND_OUTPUT:
+        return CHECK_REDIRECT;
+    case TOKEN_NEWLINE:
+        return state == CHECK_COMMAND ? CHECK_JOB_START : state;
+    default:
+        break;
+    }
+
+    // an operator or a separator ends a simple command, so it needs one
+    if (state != CHECK_COMMAND) {
+        return CHECK_SYNTAX_ERROR;
+    }
+    switch (token->tag) {
+    case TOKEN_PIPE:
+    case TOKEN_AND:
+    case TOKEN_OR:
+        return CHECK_OPERATOR;
+    default:
+        return CHECK_JOB_START;
+    }
+}
+
+// Checks the tokens after the ones checked by the previous calls. Returns
+// true if the input surely continues on the next line: it ends inside a
+// word or inside a command without errors before. Otherwise the parser
+// decides.
+bool is_input_incomplete(struct parser* parser, struct lexer* lexer,
+                         size_t checked_count) {
+    enum check_state state = parser->check_state;
+    for (size_t i = checked_count; i < lexer->tokens_count; ++i) {
+        state = check_token(state, &lexer->tokens[i]);
+        // the tokens after the kept ones are lexed again next time
+        if (i + 1 == parser->tokens_count) {
+            parser->check_state = state;
+        }
+    }
+
+    if (state == CHECK_SYNTAX_ERROR) {
+        return false;
+    }
+    return lexer->end_result == PARSING_INCOMPLETE_INPUT ||
+           state == CHECK_OPERATOR || state == CHECK_COMMAND;
+}
+
+void init_parser(struct parser* parser) {
+    init_arena(&parser->arena);
+    parser->tokens = NULL;
+    parser->tokens_count = 0;
+    parser->tokens_capacity = 0;
+    parser->input_offset = 0;
+    parser->words_end = NULL;
+    parser->words_left = 0;
+    parser->words_capacity = 0;
+    parser->word_start = NULL;
+    parser->check_state = CHECK_JOB_START;
 }
 
-enum parsing_result parse_command(char* input, struct job_command* command) {
-    struct lexer lexer = {.input = input, .is_holding_token = false};
+void reset_parser(struct parser* parser) {
+    reset_arena(&parser->arena);
+    parser->tokens_count = 0;
+    parser->input_offset = 0;
+    parser->words_end = NULL;
+    parser->words_left = 0;
+    parser->words_capacity = 0;
+    parser->word_start = NULL;
+    parser->check_state = CHECK_JOB_START;
+}
+
+void free_parser(struct parser* parser) {
+    free_arena(&parser->arena);
+    free(parser->tokens);
+    init_parser(parser);
+}
+
+enum parsing_result parse_command(struct parser* parser, char* input,
+                                  struct job_command* command) {
+    struct lexer lexer = {.arena = &parser->arena};
+    size_t checked_count = parser->tokens_count;
+    lex_input(parser, &lexer, input);
+    if (is_input_incomplete(parser, &lexer, checked_count)) {
+        return PARSING_INCOMPLETE_INPUT;
+    }
+
+    // the tree of an incomplete input is built again with more of it
+    struct arena_mark mark = mark_arena(&parser->arena);
     skip_newlines(&lexer);
-    return parse_job_command(&lexer, command);
+    enum parsing_result result = parse_job_command(&lexer, command);
+    if (result == PARSING_INCOMPLETE_INPUT) {
+        rewind_arena(&parser->arena, mark);
+    }
+    return result;
 }
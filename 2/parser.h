@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+
+#include "arena.h"
 #include "command.h"
 
 enum parsing_result {
@@ -9,4 +12,42 @@ enum parsing_result {
     PARSING_EMPTY,
 };
 
-enum parsing_result parse_command(char* input, struct job_command* command);
+struct token;
+
+// Parsing state of an input, which can come in several parts. The tokens
+// of the complete part are kept, so as the lexer continues where it has
+// stopped, and only the parser runs over them again.
+struct parser {
+    // the command tree and the words
+    struct arena arena;
+    struct token* tokens;
+    size_t tokens_count;
+    size_t tokens_capacity;
+    // where the lexer stopped
+    size_t input_offset;
+    // The words of the kept tokens. They are followed by the room for
+    // more, so as a word cut by the end of the input is continued in
+    // place.
+    char* words_end;
+    size_t words_left;
+    size_t words_capacity;
+    // the word cut inside quotes or after a backslash, NULL if none
+    char* word_start;
+    int word_escaping;
+    bool is_word_quoted;
+    // where the kept tokens have left the grammar, see check_token()
+    int check_state;
+};
+
+void init_parser(struct parser* parser);
+
+// Forgets the input and frees the last parsed command tree.
+void reset_parser(struct parser* parser);
+
+void free_parser(struct parser* parser);
+
+// Parses the whole input. After PARSING_INCOMPLETE_INPUT the caller can
+// append more to the input and call it again with the same parser.
+// Otherwise the parser should be reset before the next input.
+enum parsing_result parse_command(struct parser* parser, char* input,
+                                  struct job_command* command);
@@ -0,0 +1,227 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "path_table.h"
+
+// the search path of execvp() if PATH is not set
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+uint32_t hash_string(char* string) {
+    uint32_t hash = 2166136261u;
+    for (; *string != '\0'; ++string) {
+        hash ^= (unsigned char)*string;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+char* duplicate_string(char* string) {
+    char* copy = strdup(string);
+    if (copy == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+    return copy;
+}
+
+void init_path_table(struct path_table* table) {
+    table->buckets = NULL;
+    table->buckets_count = 0;
+    table->entries_count = 0;
+    table->path_variable = NULL;
+    table->uncached_path = NULL;
+    table->hits = 0;
+    table->misses = 0;
+}
+
+void clear_path_table(struct path_table* table) {
+    for (size_t i = 0; i < table->buckets_count; ++i) {
+        struct path_entry* entry = table->buckets[i];
+        while (entry != NULL) {
+            struct path_entry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        table->buckets[i] = NULL;
+    }
+    table->entries_count = 0;
+}
+
+void free_path_table(struct path_table* table) {
+    clear_path_table(table);
+    free(table->buckets);
+    free(table->path_variable);
+    free(table->uncached_path);
+    init_path_table(table);
+}
+
+void check_path_variable(struct path_table* table) {
+    char* path_variable = getenv("PATH");
+    if (path_variable == NULL) {
+        path_variable = DEFAULT_PATH;
+    }
+    if (table->path_variable != NULL &&
+        strcmp(table->path_variable, path_variable) == 0) {
+        return;
+    }
+
+    clear_path_table(table);
+    free(table->path_variable);
+    table->path_variable = duplicate_string(path_variable);
+}
+
+struct path_entry** find_entry(struct path_table* table, char* name) {
+    if (table->buckets_count == 0) {
+        return NULL;
+    }
+
+    struct path_entry** entry =
+        &table->buckets[hash_string(name) % table->buckets_count];
+    while (*entry != NULL && strcmp((*entry)->name, name) != 0) {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+// Doubles the buckets when there are more entries than them.
+void grow_path_table(struct path_table* table) {
+    if (table->entries_count < table->buckets_count) {
+        return;
+    }
+
+    size_t buckets_count =
+        table->buckets_count == 0 ? 64 : table->buckets_count * 2;
+    struct path_entry** buckets =
+        calloc(buckets_count, sizeof(struct path_entry*));
+    if (buckets == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+
+    for (size_t i = 0; i < table->buckets_count; ++i) {
+        struct path_entry* entry = table->buckets[i];
+        while (entry != NULL) {
+            struct path_entry* next = entry->next;
+            size_t bucket = hash_string(entry->name) % buckets_count;
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->buckets_count = buckets_count;
+}
+
+// Searches the directories like execvp() does. Returns a malloc()ed path
+// or NULL.
+char* search_path(char* path_variable, char* name) {
+    size_t name_length = strlen(name);
+    char* directory = path_variable;
+    while (true) {
+        size_t directory_length = strcspn(directory, ":");
+        char* path = malloc(directory_length + name_length + 2);
+        if (path == NULL) {
+            perror("Failed to allocate memory");
+            exit(127);
+        }
+
+        // an empty directory is the current one
+        size_t length = 0;
+        if (directory_length > 0) {
+            memcpy(path, directory, directory_length);
+            path[directory_length] = '/';
+            length = directory_length + 1;
+        }
+        memcpy(path + length, name, name_length + 1);
+
+        struct stat file_stat;
+        if (stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+            access(path, X_OK) == 0) {
+            return path;
+        }
+        free(path);
+
+        if (directory[directory_length] == '\0') {
+            return NULL;
+        }
+        directory += directory_length + 1;
+    }
+}
+
+char* add_command_path(struct path_table* table, char* name) {
+    check_path_variable(table);
+    forget_command_path(table, name);
+
+    char* path = search_path(table->path_variable, name);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    // it would change with the current directory
+    if (path[0] != '/') {
+        free(table->uncached_path);
+        table->uncached_path = path;
+        return path;
+    }
+
+    grow_path_table(table);
+    size_t name_size = strlen(name) + 1;
+    size_t path_size = strlen(path) + 1;
+    // the strings are stored after the entry
+    struct path_entry* entry =
+        malloc(sizeof(struct path_entry) + name_size + path_size);
+    if (entry == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+    entry->name = (char*)(entry + 1);
+    entry->path = entry->name + name_size;
+    memcpy(entry->name, name, name_size);
+    memcpy(entry->path, path, path_size);
+    entry->hits = 0;
+    free(path);
+
+    size_t bucket = hash_string(name) % table->buckets_count;
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    ++table->entries_count;
+    return entry->path;
+}
+
+char* find_command_path(struct path_table* table, char* name) {
+    check_path_variable(table);
+
+    struct path_entry** entry = find_entry(table, name);
+    if (entry != NULL && *entry != NULL) {
+        ++(*entry)->hits;
+        ++table->hits;
+        return (*entry)->path;
+    }
+
+    ++table->misses;
+    char* path = add_command_path(table, name);
+    // like in Bash, the use which has found the path is its first hit
+    entry = find_entry(table, name);
+    if (entry != NULL && *entry != NULL) {
+        ++(*entry)->hits;
+    }
+    return path;
+}
+
+void forget_command_path(struct path_table* table, char* name) {
+    struct path_entry** entry = find_entry(table, name);
+    if (entry == NULL || *entry == NULL) {
+        return;
+    }
+
+    struct path_entry* next = (*entry)->next;
+    free(*entry);
+    *entry = next;
+    --table->entries_count;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// The paths of the commands found in PATH, like the hash table of Bash.
+// An external command is looked up here and executed with its path, so
+// as PATH is not searched on each start.
+struct path_entry {
+    char* name;
+    char* path;
+    // how many times the path was taken from the table
+    size_t hits;
+    struct path_entry* next;
+};
+
+struct path_table {
+    struct path_entry** buckets;
+    size_t buckets_count;
+    size_t entries_count;
+    // PATH which the entries were found in, they are dropped if it changes
+    char* path_variable;
+    // a path found in a relative directory of PATH, it is not kept
+    char* uncached_path;
+    size_t hits;
+    size_t misses;
+};
+
+void init_path_table(struct path_table* table);
+void free_path_table(struct path_table* table);
+
+// Drops all the entries.
+void clear_path_table(struct path_table* table);
+
+// Drops the entries if PATH has changed since they were found.
+void check_path_variable(struct path_table* table);
+
+// Finds the executable of a command without '/'. The path is valid until
+// the next change of the table. Returns NULL if it is not in PATH.
+char* find_command_path(struct path_table* table, char* name);
+
+// Searches PATH for the command again and updates its entry.
+char* add_command_path(struct path_table* table, char* name);
+
+// Drops the entry of a command, if its path fails to execute.
+void forget_command_path(struct path_table* table, char* name);
+
+// FNV-1a
+uint32_t hash_string(char* string);
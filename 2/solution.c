@@ -1,47 +1,155 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include "command.h"
 #include "parser.h"
 
-bool read_line(char** string, size_t* length, size_t* capacity) {
-    bool is_eof = false;
+// The input is read in blocks of this size, not a byte per call.
+#define READ_BLOCK_SIZE (64 * 1024)
+
+struct reader {
+    // -1 for a string given with -c, then the buffer is the string
+    int fd;
+    char* buffer;
+    size_t position;
+    size_t length;
+};
+
+void init_reader(struct reader* reader, int fd) {
+    reader->fd = fd;
+    reader->buffer = malloc(READ_BLOCK_SIZE);
+    if (reader->buffer == NULL) {
+        perror("Failed to allocate memory");
+        exit(127);
+    }
+    reader->position = 0;
+    reader->length = 0;
+}
+
+void init_string_reader(struct reader* reader, char* string) {
+    reader->fd = -1;
+    reader->buffer = string;
+    reader->position = 0;
+    reader->length = strlen(string);
+}
+
+void free_reader(struct reader* reader) {
+    if (reader->fd < 0) {
+        return;
+    }
+    free(reader->buffer);
+    if (reader->fd > 0) {
+        close(reader->fd);
+    }
+}
+
+// Reads the next block. Returns false at the end of the input.
+bool fill_reader(struct reader* reader) {
+    if (reader->fd < 0) {
+        return false;
+    }
+
+    ssize_t size;
+    do {
+        size = read(reader->fd, reader->buffer, READ_BLOCK_SIZE);
+    } while (size < 0 && errno == EINTR);
+    if (size < 0) {
+        perror("sush: failed to read input");
+    }
+    if (size <= 0) {
+        return false;
+    }
+
+    reader->position = 0;
+    reader->length = (size_t)size;
+    return true;
+}
+
+void append_string(char** string, size_t* length, size_t* capacity,
+                   char* source, size_t size) {
+    size_t required_capacity = *length + size + 1;
+    if (required_capacity > *capacity) {
+        size_t new_capacity = *capacity * 2;
+        if (new_capacity < required_capacity) {
+            new_capacity = required_capacity;
+        }
+        *string = realloc(*string, sizeof(char) * new_capacity);
+        if (*string == NULL) {
+            perror("Failed to allocate memory");
+            exit(127);
+        }
+        *capacity = new_capacity;
+    }
+
+    memcpy(*string + *length, source, size);
+    *length += size;
+    (*string)[*length] = '\0';
+}
 
+// Appends the next line with its newline to the string. Returns true if
+// the input has ended.
+bool read_line(struct reader* reader, char** string, size_t* length,
+               size_t* capacity) {
     while (true) {
-        int character = getchar();
-        if (character != EOF) {
-            size_t required_capacity = *length + 2;
-            if (required_capacity > *capacity) {
-                *string = realloc(*string, sizeof(char) * required_capacity);
-                if (*string == NULL) {
-                    perror("Failed to allocate memory");
-                    exit(127);
-                }
-                *capacity = required_capacity;
+        if (reader->position == reader->length && !fill_reader(reader)) {
+            // the last line may have no newline, as with -c
+            if (*length > 0 && (*string)[*length - 1] != '\n') {
+                append_string(string, length, capacity, "\n", 1);
             }
+            return true;
+        }
 
-            (*string)[*length] = (char)character;
-            (*string)[*length + 1] = '\0';
-            ++*length;
+        char* start = reader->buffer + reader->position;
+        size_t available = reader->length - reader->position;
+        char* newline = memchr(start, '\n', available);
+        size_t size = available;
+        if (newline != NULL) {
+            size = (size_t)(newline - start) + 1;
         }
+        append_string(string, length, capacity, start, size);
+        reader->position += size;
 
-        if (character == '\n' || character == EOF) {
-            is_eof = character == EOF;
-            break;
+        if (newline != NULL) {
+            return false;
         }
     }
+}
 
-    return is_eof;
+void print_usage(void) {
+    fprintf(stderr, "Usage: sush [file | -c command]\n");
 }
 
-int main() {
+int main(int argc, char** argv) {
     struct execution_context context = {
         .last_exit_code = 0, .jobs = NULL, .jobs_count = 0};
+    init_path_table(&context.path_table);
+
+    // 'sush file.sh' and 'sush -c command' run a script, otherwise the
+    // commands come from stdin
+    struct reader reader;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            print_usage();
+            return 2;
+        }
+        init_string_reader(&reader, argv[2]);
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "sush: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        init_reader(&reader, fd);
+    } else {
+        init_reader(&reader, 0);
+    }
 
     char* input = malloc(sizeof(char));
     size_t input_length = 0;
@@ -53,23 +161,26 @@ int main() {
     }
     input[0] = '\0';
 
+    // the commands of a line are freed at once after the execution
+    struct parser parser;
+    init_parser(&parser);
+
     bool is_eof = false;
 
     while (true) {
 #ifdef PROMPT
         fprintf(stderr, ">> ");
 #endif
-        is_eof = read_line(&input, &input_length, &input_capacity);
+        is_eof = read_line(&reader, &input, &input_length, &input_capacity);
 
         struct job_command command;
         while (true) {
-            switch (parse_command(input, &command)) {
+            switch (parse_command(&parser, input, &command)) {
             case PARSING_SUCCESS: {
                 struct execution_result result =
                     execute_job_command(&command, &context);
                 context.last_exit_code = result.exit_code;
 
-                free_job_command(&command);
                 if (result.should_terminate) {
                     goto exit;
                 }
@@ -78,10 +189,17 @@ int main() {
             case PARSING_EMPTY:
                 break;
             case PARSING_INCOMPLETE_INPUT:
+                if (is_eof) {
+                    fprintf(stderr, "sush: syntax error: unexpected end of "
+                                    "file\n");
+                    context.last_exit_code = 127;
+                    break;
+                }
 #ifdef PROMPT
                 fprintf(stderr, ".. ");
 #endif
-                read_line(&input, &input_length, &input_capacity);
+                is_eof =
+                    read_line(&reader, &input, &input_length, &input_capacity);
                 continue;
             case PARSING_SYNTAX_ERROR:
                 fprintf(stderr, "sush: syntax error in command\n");
@@ -91,6 +209,7 @@ int main() {
 
             input[0] = '\0';
             input_length = 0;
+            reset_parser(&parser);
             break;
         }
 
@@ -114,6 +233,9 @@ exit:
     printf("exit\n");
 #endif
     free(context.jobs);
+    free_path_table(&context.path_table);
     free(input);
+    free_parser(&parser);
+    free_reader(&reader);
     return context.last_exit_code;
 }